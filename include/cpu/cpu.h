@@ -19,6 +19,8 @@
 #include <common.h>
 
 void cpu_exec(uint64_t n);
+void cpu_replay(uint64_t n);
+void cpu_commit(uint64_t n);
 
 void set_nemu_state(int state, vaddr_t pc, int halt_ret);
 void invalid_inst(vaddr_t thispc);
@@ -24,21 +24,75 @@ void difftest_skip_ref();
 void difftest_skip_dut(int nr_ref, int nr_dut);
 void difftest_set_patch(void (*fn)(void *arg), void *arg);
 void difftest_step(vaddr_t pc, vaddr_t npc);
+void difftest_dma_write(paddr_t addr, size_t n);
+void difftest_sync();
+void difftest_log_write(paddr_t addr, int len);
 void difftest_detach();
 void difftest_attach();
+#ifdef CONFIG_DIFFTEST_MEMCHECK
+extern uint8_t difftest_dirty_page[CONFIG_MSIZE / DIFFTEST_PAGE_SIZE];
+// record the pages written since the last memory checking
+static inline void difftest_mark_dirty(paddr_t addr, size_t len) {
+  paddr_t p;
+  for (p = addr - CONFIG_MBASE; p < addr - CONFIG_MBASE + len; p += DIFFTEST_PAGE_SIZE) {
+    difftest_dirty_page[p / DIFFTEST_PAGE_SIZE] = 1;
+  }
+  difftest_dirty_page[(addr - CONFIG_MBASE + len - 1) / DIFFTEST_PAGE_SIZE] = 1;
+}
+#endif
 #else
 static inline void difftest_skip_ref() {}
 static inline void difftest_skip_dut(int nr_ref, int nr_dut) {}
 static inline void difftest_set_patch(void (*fn)(void *arg), void *arg) {}
 static inline void difftest_step(vaddr_t pc, vaddr_t npc) {}
+static inline void difftest_dma_write(paddr_t addr, size_t n) {}
+static inline void difftest_sync() {}
 static inline void difftest_detach() {}
 static inline void difftest_attach() {}
 #endif
 
+// REF maps the memfd of pmem privately in lockstep mode, see init_difftest()
+#if defined(CONFIG_DIFFTEST_LOCKSTEP) && defined(CONFIG_PMEM_MEMFD)
+#define DIFFTEST_MEMSHARE 1
+extern uint8_t difftest_shared_page[CONFIG_MSIZE / DIFFTEST_PAGE_SIZE];
+void difftest_unshare_pages(paddr_t addr, size_t len);
+// Let REF copy a page still shared with DUT before DUT writes it,
+// otherwise REF would see the write before executing the instruction.
+static inline void difftest_unshare(paddr_t addr, int len) {
+  if (unlikely(difftest_shared_page[(addr - CONFIG_MBASE) / DIFFTEST_PAGE_SIZE] |
+        difftest_shared_page[(addr - CONFIG_MBASE + len - 1) / DIFFTEST_PAGE_SIZE])) {
+    difftest_unshare_pages(addr, len);
+  }
+}
+#else
+static inline void difftest_unshare(paddr_t addr, int len) {}
+#endif
+
+#ifdef CONFIG_TARGET_SHARE
+// the record to fill for the instruction being executed, NULL if not needed
+extern DifftestCommit *difftest_commit_rec;
+struct Decode;
+void difftest_commit(struct Decode *s);
+
+static inline void difftest_commit_mem(paddr_t addr, int len, word_t data, bool is_write) {
+  DifftestCommit *c = difftest_commit_rec;
+  if (c != NULL) {
+    c->maddr = addr;
+    c->mlen = len;
+    c->mwen = is_write;
+    if (is_write) c->sdata = (len < 8 ? data & ((1ull << (len * 8)) - 1) : data);
+  }
+}
+#endif
+
 extern void (*ref_difftest_memcpy)(paddr_t addr, void *buf, size_t n, bool direction);
 extern void (*ref_difftest_regcpy)(void *dut, bool direction);
 extern void (*ref_difftest_exec)(uint64_t n);
 extern void (*ref_difftest_raise_intr)(uint64_t NO);
+// optional, let REF compare exactly the first DIFFTEST_REG_SIZE bytes of
+// the DUT states, so that its registers are not copied for every instruction
+extern uint64_t (*ref_difftest_exec_cmp)(uint64_t n, const void *dut, size_t stride);
+extern uint64_t (*ref_difftest_memhash)(paddr_t addr, size_t n);
 
 static inline bool difftest_check_reg(const char *name, vaddr_t pc, word_t ref, word_t dut) {
   if (ref != dut) {
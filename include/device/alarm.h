@@ -16,9 +16,24 @@
 #ifndef __DEVICE_ALARM_H__
 #define __DEVICE_ALARM_H__
 
+#include <common.h>
+
 #define TIMER_HZ 60
 
 typedef void (*alarm_handler_t) ();
 void add_alarm_handle(alarm_handler_t h);
+// One-shot events at an absolute time of CLOCK_MONOTONIC in nanoseconds.
+// A deadline of 0 cancels the event.
+int add_alarm_event(alarm_handler_t h);
+void set_alarm_event(int id, uint64_t deadline_ns);
+uint64_t get_time_ns();
+// Call `h` when `fd` is readable. The fd is only watched once, and
+// should be watched again by rewatch_alarm_fd() after the input is consumed.
+int add_alarm_fd(int fd, alarm_handler_t h);
+void rewatch_alarm_fd(int id);
+
+// Run the handlers of the events expired since the last check.
+// Return true if the periodic alarm has expired and its handlers are run.
+bool alarm_check();
 
 #endif
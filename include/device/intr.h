@@ -0,0 +1,37 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#ifndef __DEVICE_INTR_H__
+#define __DEVICE_INTR_H__
+
+#include <common.h>
+
+#define NR_IRQ 32
+
+void dev_raise_intr();
+// set the level of the interrupt line `irq` of a device
+void dev_set_irq(int irq, bool level);
+// level of the interrupt lines of devices
+extern uint32_t dev_irq_lines;
+
+// Interrupts pending at the processor, where bit i is for the interrupt
+// with number i. This is set by the interrupt controllers, and can be
+// checked by a single load before every instruction.
+extern word_t dev_intr_pending;
+void dev_set_intr_pending(int no, bool level);
+
+void plic_update();
+
+#endif
@@ -20,6 +20,9 @@
 
 typedef void(*io_callback_t)(uint32_t, int, bool);
 uint8_t* new_space(int size);
+// Like new_space(), but backed by a memfd returned in `fd`,
+// which can be mapped by other processes to share the space.
+uint8_t* new_shared_space(const char *name, int size, int *fd);
 
 typedef struct {
   const char *name;
@@ -50,6 +53,9 @@ void add_pio_map(const char *name, ioaddr_t addr,
 void add_mmio_map(const char *name, paddr_t addr,
         void *space, uint32_t len, io_callback_t callback);
 
+// return the array of mmio maps, and the number of them in `nr`
+const IOMap* get_mmio_maps(int *nr);
+
 word_t map_read(paddr_t addr, int len, IOMap *map);
 void map_write(paddr_t addr, int len, word_t data, IOMap *map);
 
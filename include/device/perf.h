@@ -0,0 +1,41 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#ifndef __DEVICE_PERF_H__
+#define __DEVICE_PERF_H__
+
+#include <common.h>
+
+// event counters visible to the guest
+enum {
+  PERF_INSTRET,    // guest instructions retired
+  PERF_TIME_US,    // mtime of CLINT if enabled, else host time since boot, in microseconds
+  PERF_MMIO_READ,
+  PERF_MMIO_WRITE,
+  PERF_PIO_READ,
+  PERF_PIO_WRITE,
+  NR_PERF
+};
+
+#ifdef CONFIG_HAS_PERFCTR
+extern uint64_t perf_cnt[NR_PERF];
+#define perf_inc(idx) (perf_cnt[idx] ++)
+#else
+#define perf_inc(idx)
+#endif
+
+uint64_t perf_read(int idx);
+
+#endif
@@ -0,0 +1,89 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#ifndef __DEVICE_VIRTIO_H__
+#define __DEVICE_VIRTIO_H__
+
+#include <common.h>
+#include <sys/uio.h>
+
+// virtio over MMIO, see the virtio specification v1.1 section 4.2
+
+#define VIRTIO_MAX_QUEUE 4
+#define VIRTQ_MAX_SIZE 256
+// max number of segments in a descriptor chain of each direction
+#define VIRTQ_MAX_SEG 64
+
+#define VIRTIO_F_VERSION_1 32
+
+enum {
+  VIRTIO_ID_NET = 1,
+  VIRTIO_ID_BLOCK = 2,
+  VIRTIO_ID_CONSOLE = 3,
+};
+
+typedef struct {
+  uint32_t num;
+  bool ready;
+  uint64_t desc, avail, used;
+  uint16_t last_avail;
+} VirtQueue;
+
+// A descriptor chain popped from the available ring. `out` are the
+// buffers written by the driver, and `in` are the buffers to be written
+// by the device. They point to the guest memory directly.
+typedef struct {
+  uint16_t head;
+  int nr_out, nr_in;
+  size_t out_len, in_len;
+  struct iovec out[VIRTQ_MAX_SEG];
+  struct iovec in[VIRTQ_MAX_SEG];
+} VirtqElem;
+
+typedef struct VirtioDev {
+  // set by the device
+  const char *name;
+  uint32_t device_id;
+  uint64_t features;
+  int nr_queue;
+  int irq;
+  uint32_t config_size;
+  // called when the driver notifies queue `q`
+  void (*notify)(struct VirtioDev *dev, int q);
+  // called when the device is reset by the driver, optional
+  void (*reset)(struct VirtioDev *dev);
+
+  // set by the transport
+  uint8_t *base;
+  uint8_t *config; // the device-specific configuration space
+  uint64_t driver_features;
+  uint32_t status, isr;
+  uint32_t features_sel, driver_features_sel, queue_sel;
+  VirtQueue vq[VIRTIO_MAX_QUEUE];
+} VirtioDev;
+
+void virtio_mmio_init(VirtioDev *dev, paddr_t addr);
+
+// pop a descriptor chain from queue `q`, return false if there is none
+bool virtq_pop(VirtioDev *dev, int q, VirtqElem *e);
+// return the descriptor chain to queue `q` with `len` bytes written to `in`
+void virtq_push(VirtioDev *dev, int q, VirtqElem *e, uint32_t len);
+// raise the used buffer interrupt after pushing
+void virtio_notify(VirtioDev *dev);
+static inline bool virtq_ready(VirtioDev *dev, int q) {
+  return (dev->status & 4) && dev->vq[q].ready; // DRIVER_OK
+}
+
+#endif
@@ -17,6 +17,7 @@
 #define __DIFFTEST_DEF_H__
 
 #include <stdint.h>
+#include <stddef.h>
 #include <macro.h>
 #include <generated/autoconf.h>
 
@@ -37,4 +38,50 @@ enum { DIFFTEST_TO_DUT, DIFFTEST_TO_REF };
 # error Unsupport ISA
 #endif
 
+// What an instruction commits, filled by difftest_exec_commit() of NEMU REF.
+// The layout is fixed so that it can be shared with C++/SystemVerilog testbenches.
+typedef struct DifftestCommit {
+  uint64_t pc;
+  uint64_t npc;
+  uint64_t wdata; // value written to the destination register
+  uint64_t maddr; // address of the load/store
+  uint64_t sdata; // data written by the store
+  uint32_t inst;
+  uint8_t  rd;    // destination register, only valid if `wen` is set
+  uint8_t  wen;
+  uint8_t  mlen;  // number of bytes accessed in memory, 0 if no access
+  uint8_t  mwen;  // the memory access is a store
+} DifftestCommit;
+
+// memory is compared page by page with the hash below
+#define DIFFTEST_PAGE_SIZE 4096
+
+// A fast hash of memory, shared by DUT and REF. Like xxh3, the inner loop
+// works on 4 independent 64-bit lanes with 32x32->64 multiplications, so
+// it can be vectorized. The key changes with the stripe, so that swapping
+// two stripes changes the hash. `len` should be a multiple of 32.
+static inline uint64_t difftest_hash(const void *buf, size_t len) {
+  const uint64_t *p = (const uint64_t *)buf;
+  uint64_t acc[4] = { 0x9e3779b185ebca87ull, 0xc2b2ae3d27d4eb4full,
+                      0x165667b19e3779f9ull, 0x85ebca77c2b2ae63ull };
+  size_t i;
+  int j;
+  for (i = 0; i < len / 8; i += 4) {
+    uint64_t key = 0x27d4eb2f165667c5ull * (i + 1);
+    for (j = 0; j < 4; j ++) {
+      uint64_t v = p[i + j] ^ (key + j);
+      acc[j] += (v & 0xffffffff) * (v >> 32) + p[i + j];
+    }
+  }
+  uint64_t h = len * 0x9e3779b185ebca87ull;
+  for (j = 0; j < 4; j ++) {
+    h ^= acc[j] * 0xc2b2ae3d27d4eb4full;
+    h = ((h << 31) | (h >> 33)) * 0x9e3779b185ebca87ull;
+  }
+  h ^= h >> 29;
+  h *= 0x165667b19e3779f9ull;
+  h ^= h >> 32;
+  return h;
+}
+
 #endif
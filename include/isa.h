@@ -27,6 +27,8 @@ typedef concat(__GUEST_ISA__, _ISADecodeInfo) ISADecodeInfo;
 // monitor
 extern unsigned char isa_logo[];
 void init_isa();
+// set the registers to start the kernel at `entry` with the device tree at `dtb`
+void isa_boot_kernel(vaddr_t entry, paddr_t dtb);
 
 // reg
 extern CPU_state cpu;
@@ -54,5 +56,8 @@ word_t isa_query_intr();
 // difftest
 bool isa_difftest_checkregs(CPU_state *ref_r, vaddr_t pc);
 void isa_difftest_attach();
+struct DifftestCommit;
+// fill the instruction and the destination register written by `s`
+void isa_difftest_commit(struct Decode *s, struct DifftestCommit *c);
 
 #endif
@@ -34,4 +34,10 @@ static inline bool in_pmem(paddr_t addr) {
 word_t paddr_read(paddr_t addr, int len);
 void paddr_write(paddr_t addr, int len, word_t data);
 
+#ifdef CONFIG_PMEM_MEMFD
+int pmem_memfd();
+#endif
+// replace the memory with a copy-on-write view of the memfd `fd`
+void pmem_share(int fd);
+
 #endif
@@ -30,6 +30,8 @@ typedef struct {
 
 extern NEMUState nemu_state;
 
+int is_exit_status_bad();
+
 // ----------- timer -----------
 
 uint64_t get_time();
@@ -82,6 +82,32 @@ static void execute(uint64_t n) {
   }
 }
 
+// execute `n` instructions without tracing, difftest and device update,
+// used by difftest to replay the instructions after rewinding
+void cpu_replay(uint64_t n) {
+  Decode s;
+  for (;n > 0; n --) {
+    exec_once(&s, cpu.pc);
+  }
+}
+
+#ifdef CONFIG_TARGET_SHARE
+// execute at most `n` instructions like cpu_replay(), and record what each
+// of them commits, used by REF until the program ends
+void cpu_commit(uint64_t n) {
+  Decode s;
+  switch (nemu_state.state) {
+    case NEMU_END: case NEMU_ABORT: case NEMU_QUIT: return;
+    default: nemu_state.state = NEMU_RUNNING;
+  }
+  for (; n > 0 && nemu_state.state == NEMU_RUNNING; n --) {
+    exec_once(&s, cpu.pc);
+    difftest_commit(&s);
+  }
+  if (nemu_state.state == NEMU_RUNNING) nemu_state.state = NEMU_STOP;
+}
+#endif
+
 static void statistic() {
   IFNDEF(CONFIG_TARGET_AM, setlocale(LC_NUMERIC, ""));
 #define NUMBERIC_FMT MUXDEF(CONFIG_TARGET_AM, "%", "%'") PRIu64
@@ -109,6 +135,8 @@ void cpu_exec(uint64_t n) {
   uint64_t timer_start = get_time();
 
   execute(n);
+  // check the instructions which are not compared with REF yet
+  IFDEF(CONFIG_DIFFTEST, difftest_sync());
 
   uint64_t timer_end = get_time();
   g_timer += timer_end - timer_start;
@@ -17,23 +17,322 @@
 
 #include <isa.h>
 #include <cpu/cpu.h>
+#include <cpu/difftest.h>
 #include <memory/paddr.h>
+#include <memory/host.h>
 #include <utils.h>
 #include <difftest-def.h>
+#ifdef CONFIG_DIFFTEST_PIPELINE
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
 
 void (*ref_difftest_memcpy)(paddr_t addr, void *buf, size_t n, bool direction) = NULL;
 void (*ref_difftest_regcpy)(void *dut, bool direction) = NULL;
 void (*ref_difftest_exec)(uint64_t n) = NULL;
 void (*ref_difftest_raise_intr)(uint64_t NO) = NULL;
+uint64_t (*ref_difftest_exec_cmp)(uint64_t n, const void *dut, size_t stride) = NULL;
+uint64_t (*ref_difftest_memhash)(paddr_t addr, size_t n) = NULL;
 
 #ifdef CONFIG_DIFFTEST
+#ifdef CONFIG_DIFFTEST_REMOTE
+// REF runs in a helper process, see remote.c
+void* remote_open(const char *file);
+void* remote_sym(void *handle, const char *name);
+#define ref_open remote_open
+#define ref_sym  remote_sym
+#else
+#define ref_open(file) dlopen(file, RTLD_LAZY)
+#define ref_sym  dlsym
+#endif
 
 static bool is_skip_ref = false;
 static int skip_dut_nr_inst = 0;
 
+static void checkregs(CPU_state *ref, vaddr_t pc);
+
+#ifdef CONFIG_DIFFTEST_BATCH
+// In batch mode, REF runs the instructions executed by DUT since the last
+// checkpoint in one go, and the states are only compared at the end of a
+// batch. The writes to pmem in the batch are logged, so that DUT can be
+// rewound to the checkpoint to find out the first divergent instruction.
+typedef struct {
+  paddr_t addr;
+  int len;
+  word_t old;
+} UndoEntry;
+
+static UndoEntry *undo_log = NULL;
+static int nr_undo = 0, max_undo = 0;
+static CPU_state good_cpu; // the state at the last checkpoint
+static CPU_state prev_cpu; // the state after the last instruction
+static vaddr_t prev_pc;    // pc of the last instruction
+static uint64_t nr_batch = 0; // number of instructions since the checkpoint
+
+void difftest_log_write(paddr_t addr, int len) {
+  if (nr_undo == max_undo) {
+    max_undo = (max_undo == 0 ? 1024 : max_undo * 2);
+    undo_log = realloc(undo_log, max_undo * sizeof(undo_log[0]));
+    assert(undo_log);
+  }
+  undo_log[nr_undo ++] = (UndoEntry){ .addr = addr, .len = len,
+    .old = host_read(guest_to_host(addr), len) };
+}
+
+static void checkpoint() {
+  good_cpu = prev_cpu = cpu;
+  nr_undo = 0;
+  nr_batch = 0;
+}
+
+// Rewind both sides to the checkpoint, and replay `n` instructions
+// in lockstep to locate the first divergent one.
+static void find_divergence(uint64_t n) {
+  while (nr_undo > 0) {
+    UndoEntry *e = &undo_log[-- nr_undo];
+    host_write(guest_to_host(e->addr), e->len, e->old);
+  }
+  // REF may write anywhere after diverging, so sync the whole pmem
+  ref_difftest_memcpy(CONFIG_MBASE, guest_to_host(CONFIG_MBASE), CONFIG_MSIZE, DIFFTEST_TO_REF);
+  cpu = good_cpu;
+  ref_difftest_regcpy(&cpu, DIFFTEST_TO_REF);
+
+  CPU_state ref_r;
+  for (; n > 0; n --) {
+    vaddr_t pc = cpu.pc;
+    cpu_replay(1);
+    ref_difftest_exec(1);
+    ref_difftest_regcpy(&ref_r, DIFFTEST_TO_DUT);
+    checkregs(&ref_r, pc);
+    if (nemu_state.state == NEMU_ABORT) return;
+  }
+  Log("The batch mismatches with REF, but no divergence is found in replay");
+}
+
+// check the instructions in the current batch
+void difftest_sync() {
+  if (nr_batch == 0 || nemu_state.state == NEMU_ABORT) return;
+  CPU_state ref_r;
+  ref_difftest_exec(nr_batch);
+  ref_difftest_regcpy(&ref_r, DIFFTEST_TO_DUT);
+  // compare with the state after the last instruction, since this
+  // may be called in the middle of an instruction
+  CPU_state dut = cpu;
+  cpu = prev_cpu;
+  if (!isa_difftest_checkregs(&ref_r, prev_pc)) {
+    find_divergence(nr_batch);
+    if (nemu_state.state == NEMU_ABORT) return;
+  }
+  cpu = dut;
+  good_cpu = prev_cpu;
+  nr_undo = 0;
+  nr_batch = 0;
+}
+#elif defined(CONFIG_DIFFTEST_PIPELINE)
+// In pipeline mode, DUT pushes the state after every instruction into a
+// single-producer single-consumer ring, and a worker thread runs REF and
+// compares the states. DUT only waits for REF when the ring is full, or
+// before calling REF by itself. Both sides sleep on a futex after spinning
+// for a while, so an idle worker does not take a host CPU.
+#define RING_SIZE 4096 // must be a power of 2
+#define RING_SPIN 1024
+
+enum { RECORD_STEP, RECORD_SKIP_REF };
+
+typedef struct {
+  vaddr_t pc;
+  int type;
+  uint8_t regs[DIFFTEST_REG_SIZE];
+} CommitRecord;
+
+static CommitRecord ring[RING_SIZE];
+static _Atomic uint32_t ring_head = 0; // only written by DUT
+static _Atomic uint32_t ring_tail = 0; // only written by the worker
+static _Atomic uint32_t dut_sleeping = 0, worker_sleeping = 0;
+// set by the worker for a mismatch, and cleared by DUT if
+// isa_difftest_checkregs() accepts it
+static _Atomic uint32_t ref_failed = 0;
+static CommitRecord failed_record;
+static CPU_state failed_ref_r;
+
+static void futex_wait(_Atomic uint32_t *addr, uint32_t val) {
+  syscall(SYS_futex, addr, FUTEX_WAIT, val, NULL, NULL, 0);
+}
+
+static void futex_wake(_Atomic uint32_t *addr) {
+  syscall(SYS_futex, addr, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+// wait until `*addr` is no longer `val`, spin for a while before sleeping
+static void ring_wait(_Atomic uint32_t *addr, uint32_t val, _Atomic uint32_t *sleeping, int *nr_spin) {
+  if (++ *nr_spin < RING_SPIN) {
+    sched_yield();
+    return;
+  }
+  atomic_store(sleeping, 1);
+  if (atomic_load(addr) == val) futex_wait(addr, val);
+  atomic_store(sleeping, 0);
+  *nr_spin = 0;
+}
+
+static void ring_commit(uint32_t tail) {
+  atomic_store(&ring_tail, tail);
+  if (atomic_load(&dut_sleeping)) futex_wake(&ring_tail);
+}
+
+// The registers equal to REF are accepted by any ISA, but the other
+// mismatches are left to isa_difftest_checkregs(), which only runs in
+// DUT. The worker stops until DUT checks the record.
+static void record_failure(CommitRecord *r, CPU_state *ref_r, uint32_t tail) {
+  failed_record = *r;
+  failed_ref_r = *ref_r;
+  atomic_store(&ref_failed, 1);
+  ring_commit(tail);
+  while (atomic_load(&ref_failed)) futex_wait(&ref_failed, 1);
+}
+
+static void* ref_worker(void *arg) {
+  uint32_t tail = 0;
+  int nr_spin = 0;
+  while (true) {
+    uint32_t head = atomic_load_explicit(&ring_head, memory_order_acquire);
+    if (tail == head) {
+      ring_wait(&ring_head, head, &worker_sleeping, &nr_spin);
+      continue;
+    }
+    nr_spin = 0;
+    CommitRecord *r = &ring[tail % RING_SIZE];
+    CPU_state ref_r;
+    uint32_t n = 1;
+    if (r->type == RECORD_SKIP_REF) {
+      ref_difftest_regcpy(r->regs, DIFFTEST_TO_REF);
+    } else if (ref_difftest_exec_cmp != NULL) {
+      // let REF compare the following records until the end of the ring
+      while (n < head - tail && (tail + n) % RING_SIZE != 0 &&
+          ring[(tail + n) % RING_SIZE].type == RECORD_STEP) n ++;
+      uint64_t nr_match = ref_difftest_exec_cmp(n, r->regs, sizeof(CommitRecord));
+      if (nr_match < n) {
+        ref_difftest_regcpy(&ref_r, DIFFTEST_TO_DUT);
+        n = nr_match + 1;
+        record_failure(&r[nr_match], &ref_r, tail + n);
+      }
+    } else {
+      ref_difftest_exec(1);
+      ref_difftest_regcpy(&ref_r, DIFFTEST_TO_DUT);
+      if (memcmp(&ref_r, r->regs, DIFFTEST_REG_SIZE) != 0) record_failure(r, &ref_r, tail + 1);
+    }
+    tail += n;
+    ring_commit(tail);
+  }
+  return NULL;
+}
+
+// check the mismatch found by the worker with the DUT state of that instruction
+static void check_failure() {
+  if (!atomic_load_explicit(&ref_failed, memory_order_acquire) ||
+      nemu_state.state == NEMU_ABORT) return;
+  CPU_state dut = cpu;
+  memcpy(&cpu, failed_record.regs, DIFFTEST_REG_SIZE);
+  checkregs(&failed_ref_r, failed_record.pc);
+  // keep the worker stopped after aborting
+  if (nemu_state.state == NEMU_ABORT) return;
+  cpu = dut;
+  atomic_store(&ref_failed, 0);
+  futex_wake(&ref_failed);
+}
+
+static void ring_push(int type, vaddr_t pc) {
+  uint32_t head = atomic_load_explicit(&ring_head, memory_order_relaxed);
+  uint32_t tail;
+  int nr_spin = 0;
+  while (head - (tail = atomic_load(&ring_tail)) == RING_SIZE) {
+    ring_wait(&ring_tail, tail, &dut_sleeping, &nr_spin);
+  }
+  CommitRecord *r = &ring[head % RING_SIZE];
+  r->pc = pc;
+  r->type = type;
+  memcpy(r->regs, &cpu, DIFFTEST_REG_SIZE);
+  atomic_store(&ring_head, head + 1);
+  if (atomic_load(&worker_sleeping)) futex_wake(&ring_head);
+}
+
+// wait until the worker checks all instructions in the ring
+void difftest_sync() {
+  uint32_t head = atomic_load_explicit(&ring_head, memory_order_relaxed);
+  uint32_t tail;
+  int nr_spin = 0;
+  while ((tail = atomic_load(&ring_tail)) != head) {
+    check_failure();
+    if (nemu_state.state == NEMU_ABORT) return;
+    ring_wait(&ring_tail, tail, &dut_sleeping, &nr_spin);
+  }
+  check_failure();
+}
+#else
+void difftest_sync() { }
+#endif
+
+#ifdef CONFIG_DIFFTEST_MEMCHECK
+#define NR_PAGE (CONFIG_MSIZE / DIFFTEST_PAGE_SIZE)
+uint8_t difftest_dirty_page[NR_PAGE] = {};
+static uint64_t nr_inst_memcheck = 0;
+
+// compare the pages written since the last checking with their hashes in REF
+static void memcheck() {
+  static uint8_t ref_page[DIFFTEST_PAGE_SIZE];
+  uint8_t *dirty = difftest_dirty_page, *end = difftest_dirty_page + NR_PAGE;
+  while ((dirty = memchr(dirty, 1, end - dirty)) != NULL) {
+    *dirty = 0;
+    paddr_t addr = CONFIG_MBASE + (dirty - difftest_dirty_page) * DIFFTEST_PAGE_SIZE;
+    uint8_t *dut = guest_to_host(addr);
+    if (difftest_hash(dut, DIFFTEST_PAGE_SIZE) != ref_difftest_memhash(addr, DIFFTEST_PAGE_SIZE)) {
+      ref_difftest_memcpy(addr, ref_page, DIFFTEST_PAGE_SIZE, DIFFTEST_TO_DUT);
+      int i;
+      for (i = 0; i < DIFFTEST_PAGE_SIZE - 1 && ref_page[i] == dut[i]; i ++);
+      Log("memory at " FMT_PADDR " is different in the last %d instructions before pc = " FMT_WORD
+          ", right = 0x%02x, wrong = 0x%02x", addr + i, CONFIG_DIFFTEST_MEMCHECK_INTERVAL,
+          cpu.pc, ref_page[i], dut[i]);
+      nemu_state.state = NEMU_ABORT;
+      nemu_state.halt_pc = cpu.pc;
+      return;
+    }
+  }
+}
+
+static void memcheck_step() {
+  if (ref_difftest_memhash == NULL || ++ nr_inst_memcheck < CONFIG_DIFFTEST_MEMCHECK_INTERVAL) return;
+  nr_inst_memcheck = 0;
+  difftest_sync();
+  if (nemu_state.state != NEMU_ABORT) memcheck();
+}
+#endif
+
+#ifdef DIFFTEST_MEMSHARE
+uint8_t difftest_shared_page[CONFIG_MSIZE / DIFFTEST_PAGE_SIZE] = {};
+
+// writing the page in REF makes a private copy of it
+void difftest_unshare_pages(paddr_t addr, size_t len) {
+  paddr_t p;
+  for (p = (addr - CONFIG_MBASE) / DIFFTEST_PAGE_SIZE; p <= (addr - CONFIG_MBASE + len - 1) / DIFFTEST_PAGE_SIZE; p ++) {
+    if (!difftest_shared_page[p]) continue;
+    difftest_shared_page[p] = 0;
+    paddr_t page = CONFIG_MBASE + p * DIFFTEST_PAGE_SIZE;
+    ref_difftest_memcpy(page, guest_to_host(page), DIFFTEST_PAGE_SIZE, DIFFTEST_TO_REF);
+  }
+}
+#endif
+
 // this is used to let ref skip instructions which
 // can not produce consistent behavior with NEMU
 void difftest_skip_ref() {
+  // this is called in the middle of an instruction,
+  // so the batch before it should be checked first
+  IFDEF(CONFIG_DIFFTEST_BATCH, difftest_sync());
+  // in pipeline mode, it is sent to the worker by difftest_step()
   is_skip_ref = true;
   // If such an instruction is one of the instruction packing in QEMU
   // (see below), we end the process of catching up with QEMU's pc to
@@ -52,6 +351,7 @@ void difftest_skip_ref() {
 //   Let REF run `nr_ref` instructions first.
 //   We expect that DUT will catch up with REF within `nr_dut` instructions.
 void difftest_skip_dut(int nr_ref, int nr_dut) {
+  difftest_sync();
   skip_dut_nr_inst += nr_dut;
 
   while (nr_ref -- > 0) {
@@ -59,36 +359,80 @@ void difftest_skip_dut(int nr_ref, int nr_dut) {
   }
 }
 
+// this is used to let ref see the memory written by devices with DMA,
+// since such write is not performed by any instruction
+void difftest_dma_write(paddr_t addr, size_t n) {
+  difftest_sync();
+  IFDEF(CONFIG_DIFFTEST_MEMCHECK, difftest_mark_dirty(addr, n));
+  IFDEF(DIFFTEST_MEMSHARE, difftest_unshare_pages(addr, n));
+  ref_difftest_memcpy(addr, guest_to_host(addr), n, DIFFTEST_TO_REF);
+}
+
 void init_difftest(char *ref_so_file, long img_size, int port) {
   assert(ref_so_file != NULL);
 
   void *handle;
-  handle = dlopen(ref_so_file, RTLD_LAZY);
+  handle = ref_open(ref_so_file);
   assert(handle);
 
-  ref_difftest_memcpy = dlsym(handle, "difftest_memcpy");
+  ref_difftest_memcpy = ref_sym(handle, "difftest_memcpy");
   assert(ref_difftest_memcpy);
 
-  ref_difftest_regcpy = dlsym(handle, "difftest_regcpy");
+  ref_difftest_regcpy = ref_sym(handle, "difftest_regcpy");
   assert(ref_difftest_regcpy);
 
-  ref_difftest_exec = dlsym(handle, "difftest_exec");
+  ref_difftest_exec = ref_sym(handle, "difftest_exec");
   assert(ref_difftest_exec);
 
-  ref_difftest_raise_intr = dlsym(handle, "difftest_raise_intr");
+  ref_difftest_raise_intr = ref_sym(handle, "difftest_raise_intr");
   assert(ref_difftest_raise_intr);
 
-  void (*ref_difftest_init)(int) = dlsym(handle, "difftest_init");
+  // optional, let REF compare the registers by itself
+  ref_difftest_exec_cmp = ref_sym(handle, "difftest_exec_cmp");
+#ifdef CONFIG_DIFFTEST_MEMCHECK
+  ref_difftest_memhash = ref_sym(handle, "difftest_memhash");
+  if (ref_difftest_memhash == NULL) Log("%s does not support checking memory", ref_so_file);
+#endif
+
+  void (*ref_difftest_init)(int) = ref_sym(handle, "difftest_init");
   assert(ref_difftest_init);
 
   Log("Differential testing: %s", ANSI_FMT("ON", ANSI_FG_GREEN));
+#ifdef CONFIG_DIFFTEST_BATCH
+  Log("The result of every %d instructions will be compared with %s. "
+      "On a mismatch, the first divergent instruction will be located by replay.",
+      CONFIG_DIFFTEST_BATCH_SIZE, ref_so_file);
+#elif defined(CONFIG_DIFFTEST_PIPELINE)
+  Log("The result of every instruction will be compared with %s in another thread.", ref_so_file);
+#else
   Log("The result of every instruction will be compared with %s. "
       "This will help you a lot for debugging, but also significantly reduce the performance. "
       "If it is not necessary, you can turn it off in menuconfig.", ref_so_file);
+#endif
 
+  bool share = false;
+#ifdef DIFFTEST_MEMSHARE
+  // optional, let REF map the memory of DUT instead of copying the image.
+  // DUT must not run ahead of REF, and REF gets its own copy of a page
+  // before DUT writes it, so REF never sees the memory written by DUT.
+  void (*ref_difftest_memshare)(int fd, size_t size) = ref_sym(handle, "difftest_memshare");
+  if (ref_difftest_memshare != NULL) {
+    ref_difftest_memshare(pmem_memfd(), CONFIG_MSIZE);
+    memset(difftest_shared_page, 1, sizeof(difftest_shared_page));
+    share = true;
+    Log("Memory is shared with REF");
+  }
+#endif
   ref_difftest_init(port);
-  ref_difftest_memcpy(RESET_VECTOR, guest_to_host(RESET_VECTOR), img_size, DIFFTEST_TO_REF);
+  if (!share) ref_difftest_memcpy(RESET_VECTOR, guest_to_host(RESET_VECTOR), img_size, DIFFTEST_TO_REF);
   ref_difftest_regcpy(&cpu, DIFFTEST_TO_REF);
+  IFDEF(CONFIG_DIFFTEST_BATCH, checkpoint());
+#ifdef CONFIG_DIFFTEST_PIPELINE
+  pthread_t t;
+  int ret = pthread_create(&t, NULL, ref_worker, NULL);
+  Assert(ret == 0, "Can not create the thread for REF");
+  pthread_detach(t);
+#endif
 }
 
 static void checkregs(CPU_state *ref, vaddr_t pc) {
@@ -107,6 +451,7 @@ void difftest_step(vaddr_t pc, vaddr_t npc) {
     if (ref_r.pc == npc) {
       skip_dut_nr_inst = 0;
       checkregs(&ref_r, npc);
+      IFDEF(CONFIG_DIFFTEST_BATCH, checkpoint());
       return;
     }
     skip_dut_nr_inst --;
@@ -117,15 +462,38 @@ void difftest_step(vaddr_t pc, vaddr_t npc) {
 
   if (is_skip_ref) {
     // to skip the checking of an instruction, just copy the reg state to reference design
-    ref_difftest_regcpy(&cpu, DIFFTEST_TO_REF);
     is_skip_ref = false;
+#ifdef CONFIG_DIFFTEST_PIPELINE
+    ring_push(RECORD_SKIP_REF, pc);
+#else
+    ref_difftest_regcpy(&cpu, DIFFTEST_TO_REF);
+    IFDEF(CONFIG_DIFFTEST_BATCH, checkpoint());
+#endif
     return;
   }
 
-  ref_difftest_exec(1);
-  ref_difftest_regcpy(&ref_r, DIFFTEST_TO_DUT);
-
-  checkregs(&ref_r, pc);
+#if defined(CONFIG_DIFFTEST_BATCH)
+  prev_cpu = cpu;
+  prev_pc = pc;
+  if (++ nr_batch >= CONFIG_DIFFTEST_BATCH_SIZE) difftest_sync();
+#elif defined(CONFIG_DIFFTEST_PIPELINE)
+  ring_push(RECORD_STEP, pc);
+  check_failure();
+#else
+  if (ref_difftest_exec_cmp == NULL) {
+    ref_difftest_exec(1);
+    ref_difftest_regcpy(&ref_r, DIFFTEST_TO_DUT);
+    checkregs(&ref_r, pc);
+  } else {
+    // The registers of REF are only copied for a mismatch. Otherwise they
+    // are the same as DUT in the DIFFTEST_REG_SIZE bytes compared by REF,
+    // and the ISA still checks them as usual.
+    if (ref_difftest_exec_cmp(1, &cpu, 0) == 1) memcpy(&ref_r, &cpu, DIFFTEST_REG_SIZE);
+    else ref_difftest_regcpy(&ref_r, DIFFTEST_TO_DUT);
+    checkregs(&ref_r, pc);
+  }
+#endif
+  IFDEF(CONFIG_DIFFTEST_MEMCHECK, memcheck_step());
 }
 #else
 void init_difftest(char *ref_so_file, long img_size, int port) { }
@@ -15,9 +15,20 @@
 
 #include <isa.h>
 #include <cpu/cpu.h>
-#include <difftest-def.h>
+#include <cpu/decode.h>
+#include <cpu/difftest.h>
 #include <memory/paddr.h>
 
+DifftestCommit *difftest_commit_rec = NULL;
+
+void difftest_commit(Decode *s) {
+  DifftestCommit *c = difftest_commit_rec;
+  c->pc = s->pc;
+  c->npc = cpu.pc;
+  isa_difftest_commit(s, c);
+  difftest_commit_rec = c + 1;
+}
+
 __EXPORT void difftest_memcpy(paddr_t addr, void *buf, size_t n, bool direction) {
   assert(0);
 }
@@ -34,9 +45,36 @@ __EXPORT void difftest_raise_intr(word_t NO) {
   assert(0);
 }
 
+// Execute at most `n` instructions and fill one record in `rec` for each of
+// them. Return the number of instructions executed, which is less than `n`
+// if the program ends. This lets a co-simulation testbench check all the
+// instructions committed in a cycle with a single call.
+__EXPORT uint64_t difftest_exec_commit(uint64_t n, DifftestCommit *rec) {
+  memset(rec, 0, sizeof(*rec) * n);
+  difftest_commit_rec = rec;
+  cpu_commit(n);
+  n = difftest_commit_rec - rec;
+  difftest_commit_rec = NULL;
+  return n;
+}
+
+__EXPORT uint64_t difftest_memhash(paddr_t addr, size_t n) {
+  return difftest_hash(guest_to_host(addr), n);
+}
+
+static int share_fd = -1;
+
+// called before difftest_init(), let pmem be a copy-on-write view of DUT
+__EXPORT void difftest_memshare(int fd, size_t size) {
+  assert(size == CONFIG_MSIZE);
+  share_fd = fd;
+}
+
 __EXPORT void difftest_init(int port) {
   void init_mem();
   init_mem();
   /* Perform ISA dependent initialization. */
   init_isa();
+  // the built-in image loaded by init_isa() is dropped here
+  if (share_fd >= 0) pmem_share(share_fd);
 }
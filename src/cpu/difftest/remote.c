@@ -0,0 +1,373 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <common.h>
+
+#ifdef CONFIG_DIFFTEST_REMOTE
+// REF is loaded by a forked helper process, and the difftest API is called
+// through a ring of requests in shared memory. Calls without results
+// (exec, raise_intr, regcpy to REF) are only posted, and DUT waits for the
+// helper when it needs a result. Both sides spin for a while before
+// sleeping on a futex, so the latency of a call stays low.
+
+#include <dirent.h>
+#include <dlfcn.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <difftest-def.h>
+#include <memory/paddr.h>
+
+#define RING_SIZE 256
+#define BULK_SIZE (1024 * 1024)
+#define INLINE_SIZE 512
+#define DUT_SPIN (1 << 14)
+#define HELPER_SPIN (1 << 18)
+
+static_assert(DIFFTEST_REG_SIZE <= INLINE_SIZE, "registers do not fit in a request");
+
+enum {
+  OP_HELLO, OP_INIT, OP_MEMCPY, OP_REGCPY, OP_EXEC, OP_RAISE_INTR,
+  OP_EXEC_CMP, OP_MEMHASH, OP_MEMSHARE, NR_OP
+};
+
+typedef struct {
+  uint32_t op;
+  uint32_t dir;
+  uint64_t arg[3];
+  void *ptr;
+  uint8_t data[INLINE_SIZE];
+} Request;
+
+typedef struct {
+  _Atomic uint32_t head;  // written by DUT
+  _Atomic uint32_t tail;  // written by the helper
+  _Atomic uint32_t dut_sleeping;
+  _Atomic uint32_t helper_sleeping;
+  uint32_t syms;          // the APIs supported by REF, a bit for each op
+  uint64_t ret;           // result of the last request
+  uint8_t out[INLINE_SIZE];
+  Request ring[RING_SIZE];
+  uint8_t bulk[BULK_SIZE];
+} Channel;
+
+static const char *sym_name[NR_OP] = {
+  [OP_INIT] = "difftest_init", [OP_MEMCPY] = "difftest_memcpy",
+  [OP_REGCPY] = "difftest_regcpy", [OP_EXEC] = "difftest_exec",
+  [OP_RAISE_INTR] = "difftest_raise_intr", [OP_EXEC_CMP] = "difftest_exec_cmp",
+  [OP_MEMHASH] = "difftest_memhash", [OP_MEMSHARE] = "difftest_memshare",
+};
+
+static Channel *ch = NULL;
+static pid_t helper_pid = -1;
+// spinning is useless if the other side can not run at the same time
+static int dut_spin = DUT_SPIN, helper_spin = HELPER_SPIN;
+
+static void futex_wait(_Atomic uint32_t *addr, uint32_t val, const struct timespec *timeout) {
+  syscall(SYS_futex, addr, FUTEX_WAIT, val, timeout, NULL, 0);
+}
+
+static void futex_wake(_Atomic uint32_t *addr) {
+  syscall(SYS_futex, addr, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+// ---------- helper process ----------
+
+static void *ref_fn[NR_OP] = {};
+
+static void serve(Request *r) {
+  uint64_t *a = r->arg;
+  switch (r->op) {
+    case OP_HELLO: break;
+    case OP_INIT: ((void (*)(int))ref_fn[OP_INIT])(a[0]); break;
+    case OP_MEMCPY:
+      ((void (*)(paddr_t, void *, size_t, bool))ref_fn[OP_MEMCPY])(a[0], r->ptr, a[1], r->dir);
+      break;
+    case OP_REGCPY:
+      ((void (*)(void *, bool))ref_fn[OP_REGCPY])(r->dir == DIFFTEST_TO_REF ? r->data : ch->out, r->dir);
+      break;
+    case OP_EXEC: ((void (*)(uint64_t))ref_fn[OP_EXEC])(a[0]); break;
+    case OP_RAISE_INTR: ((void (*)(uint64_t))ref_fn[OP_RAISE_INTR])(a[0]); break;
+    case OP_EXEC_CMP:
+      ch->ret = ((uint64_t (*)(uint64_t, const void *, size_t))ref_fn[OP_EXEC_CMP])(a[0], ch->bulk, a[1]);
+      break;
+    case OP_MEMHASH: ch->ret = ((uint64_t (*)(paddr_t, size_t))ref_fn[OP_MEMHASH])(a[0], a[1]); break;
+    case OP_MEMSHARE: ((void (*)(int, size_t))ref_fn[OP_MEMSHARE])(a[0], a[1]); break;
+    default: assert(0);
+  }
+}
+
+// The atexit() handlers of NEMU, such as committing the sdcard overlay,
+// are inherited by the helper. This runs before them if REF calls exit().
+static void helper_exit(int status, void *arg) {
+  _exit(status);
+}
+
+// only keep stdin/stdout/stderr and the memfd which may be shared with REF
+static void close_inherited_fds() {
+  int keep = MUXDEF(CONFIG_PMEM_MEMFD, pmem_memfd(), -1);
+#ifdef SYS_close_range
+  int ret = 0;
+  if (keep > 3) ret |= syscall(SYS_close_range, 3, keep - 1, 0);
+  ret |= syscall(SYS_close_range, (keep >= 3 ? keep + 1 : 3), ~0u, 0);
+  if (ret == 0) return;
+#endif
+
+  // close_range() is only supported since Linux 5.9
+  DIR *dir = opendir("/proc/self/fd");
+  if (dir != NULL) {
+    struct dirent *d;
+    while ((d = readdir(dir)) != NULL) {
+      int fd = atoi(d->d_name); // 0 for "." and ".."
+      if (fd > 2 && fd != keep && fd != dirfd(dir)) close(fd);
+    }
+    closedir(dir);
+    return;
+  }
+  long max = sysconf(_SC_OPEN_MAX);
+  int fd;
+  for (fd = 3; fd < max; fd ++) {
+    if (fd != keep) close(fd);
+  }
+}
+
+static void __attribute__((noreturn)) helper_main(const char *file, pid_t dut) {
+  // do not outlive DUT
+  prctl(PR_SET_PDEATHSIG, SIGKILL);
+  if (getppid() != dut) _exit(1);
+  on_exit(helper_exit, NULL);
+  close_inherited_fds();
+
+  void *handle = dlopen(file, RTLD_LAZY);
+  if (handle == NULL) {
+    fprintf(stderr, "%s\n", dlerror());
+    _exit(1);
+  }
+  int i;
+  for (i = 0; i < NR_OP; i ++) {
+    if (sym_name[i] == NULL) continue;
+    ref_fn[i] = dlsym(handle, sym_name[i]);
+    if (ref_fn[i] != NULL) ch->syms |= 1u << i;
+  }
+
+  uint32_t t = 0;
+  while (true) {
+    uint32_t h;
+    int spin = 0;
+    while ((h = atomic_load(&ch->head)) == t) {
+      if (++ spin < helper_spin) continue;
+      atomic_store(&ch->helper_sleeping, 1);
+      if (atomic_load(&ch->head) == t) futex_wait(&ch->head, t, NULL);
+      atomic_store(&ch->helper_sleeping, 0);
+      spin = 0;
+    }
+    for (; t != h; t ++) {
+      serve(&ch->ring[t % RING_SIZE]);
+      atomic_store(&ch->tail, t + 1);
+      if (atomic_load(&ch->dut_sleeping)) futex_wake(&ch->tail);
+    }
+  }
+}
+
+// ---------- DUT ----------
+
+static void check_helper() {
+  int status;
+  if (waitpid(helper_pid, &status, WNOHANG) != helper_pid) return;
+  if (WIFSIGNALED(status)) panic("REF process is killed by signal %d", WTERMSIG(status));
+  panic("REF process exits with status %d", WEXITSTATUS(status));
+}
+
+// wait until the helper has served the requests before `seq`
+static void wait_for(uint32_t seq) {
+  const struct timespec timeout = { .tv_sec = 0, .tv_nsec = 100 * 1000 * 1000 };
+  uint32_t t;
+  int spin = 0;
+  while ((int32_t)((t = atomic_load(&ch->tail)) - seq) < 0) {
+    if (++ spin < dut_spin) continue;
+    atomic_store(&ch->dut_sleeping, 1);
+    if (atomic_load(&ch->tail) == t) futex_wait(&ch->tail, t, &timeout);
+    atomic_store(&ch->dut_sleeping, 0);
+    check_helper();
+    spin = 0;
+  }
+}
+
+static Request* req_alloc(uint32_t op) {
+  uint32_t h = atomic_load_explicit(&ch->head, memory_order_relaxed);
+  if (h - atomic_load(&ch->tail) == RING_SIZE) wait_for(h - RING_SIZE + 1);
+  Request *r = &ch->ring[h % RING_SIZE];
+  r->op = op;
+  return r;
+}
+
+// return the sequence number to wait for the result
+static uint32_t req_post() {
+  uint32_t h = atomic_load_explicit(&ch->head, memory_order_relaxed) + 1;
+  atomic_store(&ch->head, h);
+  if (atomic_load(&ch->helper_sleeping)) futex_wake(&ch->head);
+  return h;
+}
+
+// post the request and wait for its result
+static void call() {
+  wait_for(req_post());
+}
+
+// the helper has the same mapping of the memfd, so pmem is not copied
+static bool is_shared(void *buf, size_t n) {
+#ifdef CONFIG_PMEM_MEMFD
+  uint8_t *p = buf, *base = guest_to_host(CONFIG_MBASE);
+  return p >= base && p + n <= base + CONFIG_MSIZE;
+#else
+  return false;
+#endif
+}
+
+static void remote_memcpy(paddr_t addr, void *buf, size_t n, bool direction) {
+  Request *r;
+  if (is_shared(buf, n)) {
+    r = req_alloc(OP_MEMCPY);
+    r->dir = direction;
+    r->arg[0] = addr;
+    r->arg[1] = n;
+    r->ptr = buf;
+    call();
+    return;
+  }
+  uint8_t *p = buf;
+  while (n > 0) {
+    size_t len = (n < BULK_SIZE ? n : BULK_SIZE);
+    r = req_alloc(OP_MEMCPY);
+    r->dir = direction;
+    r->arg[0] = addr;
+    r->arg[1] = len;
+    r->ptr = ch->bulk;
+    if (direction == DIFFTEST_TO_REF) memcpy(ch->bulk, p, len);
+    call();
+    if (direction == DIFFTEST_TO_DUT) memcpy(p, ch->bulk, len);
+    addr += len;
+    p += len;
+    n -= len;
+  }
+}
+
+static void remote_regcpy(void *dut, bool direction) {
+  Request *r = req_alloc(OP_REGCPY);
+  r->dir = direction;
+  if (direction == DIFFTEST_TO_REF) {
+    memcpy(r->data, dut, DIFFTEST_REG_SIZE);
+    req_post();
+  } else {
+    call();
+    memcpy(dut, ch->out, DIFFTEST_REG_SIZE);
+  }
+}
+
+static void remote_exec(uint64_t n) {
+  Request *r = req_alloc(OP_EXEC);
+  r->arg[0] = n;
+  req_post();
+}
+
+static void remote_raise_intr(uint64_t NO) {
+  Request *r = req_alloc(OP_RAISE_INTR);
+  r->arg[0] = NO;
+  req_post();
+}
+
+static uint64_t remote_exec_cmp(uint64_t n, const void *dut, size_t stride) {
+  const uint8_t *p = dut;
+  uint64_t total = 0;
+  uint64_t max = (stride == 0 ? n : (BULK_SIZE - DIFFTEST_REG_SIZE) / stride + 1);
+  while (n > 0) {
+    uint64_t k = (n < max ? n : max);
+    Request *r = req_alloc(OP_EXEC_CMP);
+    r->arg[0] = k;
+    r->arg[1] = stride;
+    memcpy(ch->bulk, p, (k - 1) * stride + DIFFTEST_REG_SIZE);
+    call();
+    total += ch->ret;
+    if (ch->ret < k) break;
+    p += k * stride;
+    n -= k;
+  }
+  return total;
+}
+
+static uint64_t remote_memhash(paddr_t addr, size_t n) {
+  Request *r = req_alloc(OP_MEMHASH);
+  r->arg[0] = addr;
+  r->arg[1] = n;
+  call();
+  return ch->ret;
+}
+
+// the fd is inherited by the helper
+static void remote_memshare(int fd, size_t size) {
+  Request *r = req_alloc(OP_MEMSHARE);
+  r->arg[0] = fd;
+  r->arg[1] = size;
+  call();
+}
+
+static void remote_init(int port) {
+  Request *r = req_alloc(OP_INIT);
+  r->arg[0] = port;
+  call();
+}
+
+static void *stub[NR_OP] = {
+  [OP_INIT] = remote_init, [OP_MEMCPY] = remote_memcpy,
+  [OP_REGCPY] = remote_regcpy, [OP_EXEC] = remote_exec,
+  [OP_RAISE_INTR] = remote_raise_intr, [OP_EXEC_CMP] = remote_exec_cmp,
+  [OP_MEMHASH] = remote_memhash, [OP_MEMSHARE] = remote_memshare,
+};
+
+// start the helper process to load REF, the handle returned is only for remote_sym()
+void* remote_open(const char *file) {
+  ch = mmap(NULL, sizeof(*ch), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  Assert(ch != MAP_FAILED, "can not allocate the channel to REF");
+
+  if (sysconf(_SC_NPROCESSORS_ONLN) == 1) dut_spin = helper_spin = 0;
+
+  fflush(NULL);
+  pid_t dut = getpid();
+  helper_pid = fork();
+  Assert(helper_pid >= 0, "can not create the process for REF");
+  if (helper_pid == 0) helper_main(file, dut);
+
+  // wait until REF is loaded
+  req_alloc(OP_HELLO);
+  call();
+  Log("REF is running in process %d", helper_pid);
+  return ch;
+}
+
+void* remote_sym(void *handle, const char *name) {
+  int i;
+  for (i = 0; i < NR_OP; i ++) {
+    if (sym_name[i] != NULL && strcmp(sym_name[i], name) == 0) {
+      return (ch->syms & (1u << i)) ? stub[i] : NULL;
+    }
+  }
+  return NULL;
+}
+#endif
@@ -15,37 +15,157 @@
 
 #include <common.h>
 #include <device/alarm.h>
-#include <sys/time.h>
+#include <sys/timerfd.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <signal.h>
+#include <errno.h>
+#include <stdatomic.h>
 
 #define MAX_HANDLER 8
+#define MAX_EVENT 8
 
 static alarm_handler_t handler[MAX_HANDLER] = {};
 static int idx = 0;
+static alarm_handler_t event_handler[MAX_EVENT] = {};
+static int event_fd[MAX_EVENT] = {};
+static bool event_is_timer[MAX_EVENT] = {};
+static int nr_event = 0;
+static int timer_fd = -1;
+static int epoll_fd = -1;
+// Events not yet handled, set by the alarm thread. Bit 0 is for the
+// periodic alarm, and bit (i + 1) is for event i.
+static atomic_uint pending = 0;
 
 void add_alarm_handle(alarm_handler_t h) {
   assert(idx < MAX_HANDLER);
   handler[idx ++] = h;
 }
 
-static void alarm_sig_handler(int signum) {
+static void watch_fd(int fd, int bit, bool oneshot) {
+  // events can be added by devices before init_alarm()
+  if (epoll_fd == -1) {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    Assert(epoll_fd != -1, "Can not create epoll");
+  }
+  struct epoll_event ev = { .events = EPOLLIN | (oneshot ? EPOLLONESHOT : 0), .data.u32 = bit };
+  int ret = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+  Assert(ret == 0, "Can not watch fd %d", fd);
+}
+
+static int add_event(int fd, alarm_handler_t h, bool is_timer) {
+  assert(nr_event < MAX_EVENT);
+  event_handler[nr_event] = h;
+  event_fd[nr_event] = fd;
+  event_is_timer[nr_event] = is_timer;
+  watch_fd(fd, nr_event + 1, !is_timer);
+  return nr_event ++;
+}
+
+int add_alarm_event(alarm_handler_t h) {
+  int fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+  Assert(fd != -1, "Can not create timer");
+  return add_event(fd, h, true);
+}
+
+int add_alarm_fd(int fd, alarm_handler_t h) {
+  return add_event(fd, h, false);
+}
+
+void rewatch_alarm_fd(int id) {
+  assert(id < nr_event && !event_is_timer[id]);
+  struct epoll_event ev = { .events = EPOLLIN | EPOLLONESHOT, .data.u32 = id + 1 };
+  int ret = epoll_ctl(epoll_fd, EPOLL_CTL_MOD, event_fd[id], &ev);
+  assert(ret == 0);
+}
+
+void set_alarm_event(int id, uint64_t deadline_ns) {
+  assert(id < nr_event && event_is_timer[id]);
+  struct itimerspec it = {};
+  if (deadline_ns != 0) {
+    uint64_t now = get_time_ns();
+    if (deadline_ns <= now) {
+      // already expired
+      atomic_fetch_or_explicit(&pending, 2u << id, memory_order_release);
+    } else {
+      it.it_value.tv_sec = deadline_ns / 1000000000;
+      it.it_value.tv_nsec = deadline_ns % 1000000000;
+    }
+  }
+  // a zero it_value disarms the timer
+  int ret = timerfd_settime(event_fd[id], TFD_TIMER_ABSTIME, &it, NULL);
+  assert(ret == 0);
+}
+
+uint64_t get_time_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+// The events are waited by a helper thread, so that the execution loop is
+// never interrupted by a signal. It only needs to check the atomic bitmask.
+static void* alarm_thread(void *arg) {
+  struct epoll_event ev[MAX_EVENT + 1];
+  while (true) {
+    int n = epoll_wait(epoll_fd, ev, ARRLEN(ev), -1);
+    if (n < 0) {
+      Assert(errno == EINTR, "epoll_wait() fails in alarm thread");
+      continue;
+    }
+    unsigned mask = 0;
+    int i;
+    for (i = 0; i < n; i ++) {
+      int bit = ev[i].data.u32;
+      if (bit == 0 || event_is_timer[bit - 1]) {
+        uint64_t expirations;
+        if (read(bit == 0 ? timer_fd : event_fd[bit - 1], &expirations, sizeof(expirations)) <= 0) continue;
+      }
+      // fds are not read here, and they are watched again by rewatch_alarm_fd()
+      mask |= 1u << bit;
+    }
+    if (mask) atomic_fetch_or_explicit(&pending, mask, memory_order_release);
+  }
+  return NULL;
+}
+
+bool alarm_check() {
+  if (likely(atomic_load_explicit(&pending, memory_order_relaxed) == 0)) return false;
+  // ticks arriving together are coalesced into one
+  unsigned mask = atomic_exchange_explicit(&pending, 0, memory_order_acquire);
   int i;
+  for (i = 0; i < nr_event; i ++) {
+    if (!(mask & (2u << i))) continue;
+    event_handler[i]();
+  }
+  if (!(mask & 1)) return false;
   for (i = 0; i < idx; i ++) {
     handler[i]();
   }
+  return true;
 }
 
 void init_alarm() {
-  struct sigaction s;
-  memset(&s, 0, sizeof(s));
-  s.sa_handler = alarm_sig_handler;
-  int ret = sigaction(SIGVTALRM, &s, NULL);
-  Assert(ret == 0, "Can not set signal handler");
+  timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+  Assert(timer_fd != -1, "Can not create timer");
 
-  struct itimerval it = {};
+  struct itimerspec it = {};
   it.it_value.tv_sec = 0;
-  it.it_value.tv_usec = 1000000 / TIMER_HZ;
+  it.it_value.tv_nsec = 1000000000 / TIMER_HZ;
   it.it_interval = it.it_value;
-  ret = setitimer(ITIMER_VIRTUAL, &it, NULL);
+  int ret = timerfd_settime(timer_fd, 0, &it, NULL);
   Assert(ret == 0, "Can not set timer");
+  watch_fd(timer_fd, 0, false);
+
+  // signals are handled by the main thread, and the alarm thread
+  // inherits the mask with all signals blocked
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  pthread_t thread;
+  ret = pthread_create(&thread, NULL, alarm_thread, NULL);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  Assert(ret == 0, "Can not create alarm thread");
+  pthread_detach(thread);
 }
@@ -0,0 +1,76 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <isa.h>
+#include <device/map.h>
+#include <device/alarm.h>
+#include <device/intr.h>
+
+// RISC-V core local interruptor with a single hart
+
+#define CLINT_MSIP     0x0000
+#define CLINT_MTIMECMP 0x4000
+#define CLINT_MTIME    0xbff8
+#define CLINT_SIZE     0x10000
+
+// mtime ticks at 1MHz
+#define NS_PER_TICK 1000
+
+static uint8_t *clint_base = NULL;
+static uint64_t mtime_base_ns = 0; // host time when mtime is 0
+static int mtimecmp_event = -1;
+
+uint64_t clint_mtime() {
+  return (get_time_ns() - mtime_base_ns) / NS_PER_TICK;
+}
+
+// Instead of comparing mtime with mtimecmp before every instruction,
+// the deadline is scheduled as an alarm event.
+static void update_mtip() {
+  uint64_t mtimecmp = *(uint64_t *)(clint_base + CLINT_MTIMECMP);
+  bool expired = clint_mtime() >= mtimecmp;
+  dev_set_intr_pending(IRQ_M_TIMER, expired);
+  if (!expired) {
+    // a deadline too far away is treated as never
+    bool never = mtimecmp > (UINT64_MAX - mtime_base_ns) / NS_PER_TICK;
+    set_alarm_event(mtimecmp_event, (never ? 0 : mtime_base_ns + mtimecmp * NS_PER_TICK));
+  }
+}
+
+static void clint_io_handler(uint32_t offset, int len, bool is_write) {
+  if (offset >= CLINT_MTIME && offset < CLINT_MTIME + 8) {
+    uint64_t *mtime = (uint64_t *)(clint_base + CLINT_MTIME);
+    if (is_write) mtime_base_ns = get_time_ns() - *mtime * NS_PER_TICK;
+    else *mtime = clint_mtime();
+    update_mtip();
+  } else if (offset >= CLINT_MTIMECMP && offset < CLINT_MTIMECMP + 8) {
+    if (is_write) update_mtip();
+  } else if (offset < CLINT_MSIP + 4) {
+    if (is_write) {
+      clint_base[CLINT_MSIP] &= 1;
+      dev_set_intr_pending(IRQ_M_SOFT, clint_base[CLINT_MSIP]);
+    }
+  }
+}
+
+void init_clint() {
+  clint_base = new_space(CLINT_SIZE);
+  memset(clint_base, 0, CLINT_SIZE);
+  // never expire before mtimecmp is set
+  *(uint64_t *)(clint_base + CLINT_MTIMECMP) = UINT64_MAX;
+  add_mmio_map("clint", CONFIG_CLINT_MMIO, clint_base, CLINT_SIZE, clint_io_handler);
+  mtime_base_ns = get_time_ns();
+  mtimecmp_event = add_alarm_event(update_mtip);
+}
@@ -23,24 +23,41 @@
 void init_map();
 void init_serial();
 void init_timer();
+void init_clint();
+void init_plic();
 void init_vga();
 void init_i8042();
 void init_audio();
 void init_disk();
 void init_sdcard();
+void init_dma();
+void init_perfctr();
+void init_virtio_console();
+void init_virtio_net();
 void init_alarm();
 
 void send_key(uint8_t, bool);
 void vga_update_screen();
+void serial_update();
+void virtio_console_update();
 
 void device_update() {
+#ifdef CONFIG_TARGET_AM
   static uint64_t last = 0;
   uint64_t now = get_time();
   if (now - last < 1000000 / TIMER_HZ) {
     return;
   }
   last = now;
+#else
+  // the alarm ticks at TIMER_HZ
+  if (!alarm_check()) {
+    return;
+  }
+#endif
 
+  IFDEF(CONFIG_HAS_SERIAL, serial_update());
+  IFDEF(CONFIG_HAS_VIRTIO_CONSOLE, virtio_console_update());
   IFDEF(CONFIG_HAS_VGA, vga_update_screen());
 
 #ifndef CONFIG_TARGET_AM
@@ -79,11 +96,17 @@ void init_device() {
 
   IFDEF(CONFIG_HAS_SERIAL, init_serial());
   IFDEF(CONFIG_HAS_TIMER, init_timer());
+  IFDEF(CONFIG_HAS_CLINT, init_clint());
+  IFDEF(CONFIG_HAS_PLIC, init_plic());
   IFDEF(CONFIG_HAS_VGA, init_vga());
   IFDEF(CONFIG_HAS_KEYBOARD, init_i8042());
   IFDEF(CONFIG_HAS_AUDIO, init_audio());
   IFDEF(CONFIG_HAS_DISK, init_disk());
   IFDEF(CONFIG_HAS_SDCARD, init_sdcard());
+  IFDEF(CONFIG_HAS_DMA, init_dma());
+  IFDEF(CONFIG_HAS_PERFCTR, init_perfctr());
+  IFDEF(CONFIG_HAS_VIRTIO_CONSOLE, init_virtio_console());
+  IFDEF(CONFIG_HAS_VIRTIO_NET, init_virtio_net());
 
   IFNDEF(CONFIG_TARGET_AM, init_alarm());
 }
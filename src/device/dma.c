@@ -0,0 +1,78 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <device/map.h>
+#include <device/intr.h>
+#include <memory/paddr.h>
+
+// A simple DMA controller to copy or fill a region of the guest memory.
+// The operation is started by writing DMA_CMD, and is finished at once.
+
+enum {
+  DMA_SRC,    // source address for copy
+  DMA_DST,    // destination address
+  DMA_LEN,    // length in bytes
+  DMA_FILL,   // the byte to fill
+  DMA_CMD,    // write to start
+  DMA_STATUS, // write to clear
+  DMA_IE,     // raise an interrupt when done if non-zero
+  NR_REG
+};
+
+enum { CMD_COPY = 1, CMD_FILL = 2 };
+#define STATUS_DONE  0x1
+#define STATUS_ERROR 0x2
+
+static uint32_t *dma_base = NULL;
+
+static bool in_pmem_range(paddr_t addr, uint32_t len) {
+  return in_pmem(addr) && len <= CONFIG_MSIZE - (addr - CONFIG_MBASE);
+}
+
+static uint32_t dma_start() {
+  paddr_t src = dma_base[DMA_SRC], dst = dma_base[DMA_DST];
+  uint32_t len = dma_base[DMA_LEN];
+  if (len == 0) return STATUS_DONE;
+  if (!in_pmem_range(dst, len)) return STATUS_ERROR;
+  switch (dma_base[DMA_CMD]) {
+    case CMD_COPY:
+      if (!in_pmem_range(src, len)) return STATUS_ERROR;
+      memmove(guest_to_host(dst), guest_to_host(src), len);
+      break;
+    case CMD_FILL:
+      memset(guest_to_host(dst), dma_base[DMA_FILL] & 0xff, len);
+      break;
+    default: return STATUS_ERROR;
+  }
+  difftest_dma_write(dst, len);
+  return STATUS_DONE;
+}
+
+static void dma_io_handler(uint32_t offset, int len, bool is_write) {
+  assert(len == 4);
+  if (!is_write) return;
+  switch (offset / 4) {
+    case DMA_CMD: dma_base[DMA_STATUS] = dma_start(); break;
+    case DMA_STATUS: dma_base[DMA_STATUS] = 0; break;
+    default: break;
+  }
+  dev_set_irq(CONFIG_DMA_IRQ, dma_base[DMA_IE] && dma_base[DMA_STATUS]);
+}
+
+void init_dma() {
+  dma_base = (uint32_t *)new_space(NR_REG * sizeof(uint32_t));
+  memset(dma_base, 0, NR_REG * sizeof(uint32_t));
+  add_mmio_map("dma", CONFIG_DMA_CTL_MMIO, dma_base, NR_REG * sizeof(uint32_t), dma_io_handler);
+}
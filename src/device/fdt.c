@@ -0,0 +1,254 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <isa.h>
+#include <device/map.h>
+#include <memory/paddr.h>
+
+// Generate the flattened device tree from the mmio maps registered, see
+// https://devicetree-specification.readthedocs.io/en/stable/flattened-format.html
+
+#define FDT_MAGIC 0xd00dfeed
+#define FDT_BEGIN_NODE 1
+#define FDT_END_NODE 2
+#define FDT_PROP 3
+#define FDT_END 9
+
+#define FDT_MAX_STRUCT 8192
+#define FDT_MAX_STRINGS 1024
+
+enum { PHANDLE_INTC = 1, PHANDLE_PLIC };
+
+static uint32_t fdt_struct[FDT_MAX_STRUCT / 4];
+static int struct_len = 0; // in words
+static char fdt_strings[FDT_MAX_STRINGS];
+static int strings_len = 0;
+
+static inline uint32_t be32(uint32_t x) { return __builtin_bswap32(x); }
+
+static void put_word(uint32_t w) {
+  Assert(struct_len < ARRLEN(fdt_struct), "device tree is too large");
+  fdt_struct[struct_len ++] = be32(w);
+}
+
+// put `len` bytes padded to words
+static void put_bytes(const void *data, int len) {
+  Assert(struct_len + (len + 3) / 4 <= ARRLEN(fdt_struct), "device tree is too large");
+  uint8_t *p = (uint8_t *)&fdt_struct[struct_len];
+  if (len > 0) memcpy(p, data, len);
+  memset(p + len, 0, -len & 3);
+  struct_len += (len + 3) / 4;
+}
+
+static int string_offset(const char *s) {
+  int i;
+  for (i = 0; i < strings_len; i += strlen(fdt_strings + i) + 1) {
+    if (strcmp(fdt_strings + i, s) == 0) return i;
+  }
+  int len = strlen(s) + 1;
+  Assert(strings_len + len <= FDT_MAX_STRINGS, "device tree is too large");
+  memcpy(fdt_strings + strings_len, s, len);
+  strings_len += len;
+  return i;
+}
+
+static void begin_node(const char *name) {
+  put_word(FDT_BEGIN_NODE);
+  put_bytes(name, strlen(name) + 1);
+}
+
+static void end_node() { put_word(FDT_END_NODE); }
+
+static void prop(const char *name, const void *data, int len) {
+  put_word(FDT_PROP);
+  put_word(len);
+  put_word(string_offset(name));
+  put_bytes(data, len);
+}
+
+static void prop_cells(const char *name, const uint32_t *cells, int n) {
+  uint32_t buf[n];
+  int i;
+  for (i = 0; i < n; i ++) buf[i] = be32(cells[i]);
+  prop(name, buf, n * 4);
+}
+
+#define prop_u32(name, ...) do { \
+    uint32_t __cells[] = { __VA_ARGS__ }; \
+    prop_cells(name, __cells, ARRLEN(__cells)); \
+  } while (0)
+#define prop_str(name, s) prop(name, s, sizeof(s))
+
+// with #address-cells = <2> and #size-cells = <2>
+static void prop_reg(uint64_t addr, uint64_t size) {
+  prop_u32("reg", addr >> 32, (uint32_t)addr, size >> 32, (uint32_t)size);
+}
+
+static void begin_node_at(const char *name, paddr_t addr) {
+  char buf[64];
+  snprintf(buf, sizeof(buf), "%s@%x", name, (uint32_t)addr);
+  begin_node(buf);
+}
+
+static void gen_cpus() {
+  begin_node("cpus");
+  prop_u32("#address-cells", 1);
+  prop_u32("#size-cells", 0);
+  prop_u32("timebase-frequency", 1000000); // the frequency of mtime of CLINT
+  begin_node("cpu@0");
+  prop_str("device_type", "cpu");
+  prop_u32("reg", 0);
+  prop_str("compatible", "riscv");
+  prop_str("riscv,isa", MUXDEF(CONFIG_RV64, "rv64ima", "rv32ima"));
+  prop_str("status", "okay");
+  begin_node("interrupt-controller");
+  prop_str("compatible", "riscv,cpu-intc");
+  prop_u32("#interrupt-cells", 1);
+  prop("interrupt-controller", NULL, 0);
+  prop_u32("phandle", PHANDLE_INTC);
+  end_node();
+  end_node();
+  end_node();
+}
+
+static void gen_serial(const IOMap *map) {
+  prop_str("compatible", "ns16550a");
+  prop_u32("clock-frequency", 3686400);
+  prop_u32("reg-shift", 0);
+  prop_u32("reg-io-width", 1);
+  IFDEF(CONFIG_HAS_SERIAL, prop_u32("interrupts", CONFIG_SERIAL_IRQ));
+}
+
+static void gen_clint(const IOMap *map) {
+  prop_str("compatible", "riscv,clint0");
+  prop_u32("interrupts-extended", PHANDLE_INTC, IRQ_M_SOFT, PHANDLE_INTC, IRQ_M_TIMER);
+}
+
+static void gen_plic(const IOMap *map) {
+  prop_str("compatible", "riscv,plic0");
+  prop_u32("#address-cells", 0);
+  prop_u32("#interrupt-cells", 1);
+  prop("interrupt-controller", NULL, 0);
+  prop_u32("interrupts-extended", PHANDLE_INTC, IRQ_M_EXT, PHANDLE_INTC, IRQ_S_EXT);
+  prop_u32("riscv,ndev", 31);
+  prop_u32("phandle", PHANDLE_PLIC);
+}
+
+static void gen_sdcard(const IOMap *map) {
+  prop_str("compatible", "nemu-sdhost");
+}
+
+static void gen_framebuffer(const IOMap *map) {
+  int w = MUXDEF(CONFIG_VGA_SIZE_800x600, 800, 400);
+  int h = MUXDEF(CONFIG_VGA_SIZE_800x600, 600, 300);
+  prop_str("compatible", "simple-framebuffer");
+  prop_u32("width", w);
+  prop_u32("height", h);
+  prop_u32("stride", w * 4);
+  prop_str("format", "a8r8g8b8");
+}
+
+static void gen_virtio(const IOMap *map) {
+  prop_str("compatible", "virtio,mmio");
+  int irq = -1;
+  IFDEF(CONFIG_HAS_VIRTIO_CONSOLE, if (strcmp(map->name, "virtio-console") == 0) irq = CONFIG_VIRTIO_CONSOLE_IRQ);
+  IFDEF(CONFIG_HAS_VIRTIO_NET, if (strcmp(map->name, "virtio-net") == 0) irq = CONFIG_VIRTIO_NET_IRQ);
+  if (irq != -1) prop_u32("interrupts", irq);
+}
+
+// devices not listed here do not have drivers in Linux
+static const struct {
+  const char *map_name;
+  const char *node_name;
+  void (*gen)(const IOMap *map);
+} dev_table[] = {
+  { "serial", "serial", gen_serial },
+  { "clint", "clint", gen_clint },
+  { "plic", "interrupt-controller", gen_plic },
+  { "sdhci", "mmc", gen_sdcard },
+  { "vmem", "framebuffer", gen_framebuffer },
+  { "virtio-console", "virtio_mmio", gen_virtio },
+  { "virtio-net", "virtio_mmio", gen_virtio },
+};
+
+static void gen_soc() {
+  begin_node("soc");
+  prop_u32("#address-cells", 2);
+  prop_u32("#size-cells", 2);
+  prop_str("compatible", "simple-bus");
+  prop("ranges", NULL, 0);
+  IFDEF(CONFIG_HAS_PLIC, prop_u32("interrupt-parent", PHANDLE_PLIC));
+  int nr, i, j;
+  const IOMap *maps = get_mmio_maps(&nr);
+  for (i = 0; i < nr; i ++) {
+    for (j = 0; j < ARRLEN(dev_table); j ++) {
+      if (strcmp(maps[i].name, dev_table[j].map_name) != 0) continue;
+      begin_node_at(dev_table[j].node_name, maps[i].low);
+      prop_reg(maps[i].low, maps[i].high - maps[i].low + 1);
+      dev_table[j].gen(&maps[i]);
+      end_node();
+    }
+  }
+  end_node();
+}
+
+static void gen_chosen(paddr_t initrd_start, paddr_t initrd_end) {
+  begin_node("chosen");
+  prop_str("bootargs", CONFIG_DTB_BOOTARGS);
+  if (initrd_start != initrd_end) {
+    prop_u32("linux,initrd-start", 0, initrd_start);
+    prop_u32("linux,initrd-end", 0, initrd_end);
+  }
+  end_node();
+}
+
+// Generate the device tree at `addr` and return its size.
+// Set `initrd_start` and `initrd_end` to 0 if there is no initrd.
+long gen_dtb(paddr_t addr, paddr_t initrd_start, paddr_t initrd_end) {
+  struct_len = strings_len = 0;
+  begin_node("");
+  prop_u32("#address-cells", 2);
+  prop_u32("#size-cells", 2);
+  prop_str("compatible", "nemu");
+  prop_str("model", "NEMU");
+  gen_cpus();
+  begin_node_at("memory", CONFIG_MBASE);
+  prop_str("device_type", "memory");
+  prop_reg(CONFIG_MBASE, CONFIG_MSIZE);
+  end_node();
+  gen_soc();
+  gen_chosen(initrd_start, initrd_end);
+  end_node();
+  put_word(FDT_END);
+
+  // header | memory reservation block | structure block | strings block
+  uint32_t header[10];
+  uint32_t off_rsvmap = sizeof(header);
+  uint32_t off_struct = off_rsvmap + 16; // only the terminating entry
+  uint32_t off_strings = off_struct + struct_len * 4;
+  uint32_t total = off_strings + strings_len;
+  Assert(in_pmem(addr) && total <= PMEM_RIGHT - addr + 1, "device tree can not be placed at " FMT_PADDR, addr);
+  uint32_t h[] = { FDT_MAGIC, total, off_struct, off_strings, off_rsvmap,
+    17, 16, 0, strings_len, struct_len * 4 };
+  int i;
+  for (i = 0; i < ARRLEN(h); i ++) header[i] = be32(h[i]);
+
+  uint8_t *p = guest_to_host(addr);
+  memcpy(p, header, sizeof(header));
+  memset(p + off_rsvmap, 0, 16);
+  memcpy(p + off_struct, fdt_struct, struct_len * 4);
+  memcpy(p + off_strings, fdt_strings, strings_len);
+  return total;
+}
@@ -14,6 +14,32 @@
 ***************************************************************************************/
 
 #include <isa.h>
+#include <device/intr.h>
+
+uint32_t dev_irq_lines = 0;
+word_t dev_intr_pending = 0;
 
 void dev_raise_intr() {
 }
+
+void dev_set_irq(int irq, bool level) {
+  assert(irq > 0 && irq < NR_IRQ);
+  uint32_t mask = 1u << irq;
+  bool old = (dev_irq_lines & mask) != 0;
+  if (level == old) return;
+  if (level) dev_irq_lines |= mask;
+  else dev_irq_lines &= ~mask;
+#ifdef CONFIG_HAS_PLIC
+  plic_update();
+#else
+  if (level) dev_raise_intr();
+#endif
+}
+
+void dev_set_intr_pending(int no, bool level) {
+  word_t mask = (word_t)1 << no;
+  bool old = (dev_intr_pending & mask) != 0;
+  if (level) dev_intr_pending |= mask;
+  else dev_intr_pending &= ~mask;
+  if (level && !old) dev_raise_intr();
+}
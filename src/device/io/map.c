@@ -13,24 +13,65 @@
 * See the Mulan PSL v2 for more details.
 ***************************************************************************************/
 
+#define _GNU_SOURCE // for memfd_create()
 #include <isa.h>
 #include <memory/host.h>
 #include <memory/vaddr.h>
 #include <device/map.h>
 
+#ifdef CONFIG_TARGET_AM
 #define IO_SPACE_MAX (32 * 1024 * 1024)
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+// Only the address space is reserved at first, and the pages are
+// committed when allocated, so this can be much larger than needed.
+#define IO_SPACE_MAX (4ull * 1024 * 1024 * 1024)
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#endif
 
 static uint8_t *io_space = NULL;
 static uint8_t *p_space = NULL;
 
-uint8_t* new_space(int size) {
-  uint8_t *p = p_space;
+static uint8_t* alloc_space(size_t *size) {
   // page aligned;
-  size = (size + (PAGE_SIZE - 1)) & ~PAGE_MASK;
-  p_space += size;
-  assert(p_space - io_space < IO_SPACE_MAX);
+  *size = (*size + (PAGE_SIZE - 1)) & ~PAGE_MASK;
+#ifndef CONFIG_TARGET_AM
+  // large regions are aligned to huge pages to be backed by them
+  if (*size >= HUGE_PAGE_SIZE) {
+    p_space = (uint8_t *)ROUNDUP(p_space, HUGE_PAGE_SIZE);
+  }
+#endif
+  uint8_t *p = p_space;
+  Assert(*size <= IO_SPACE_MAX - (p_space - io_space), "device memory is used up");
+  p_space += *size;
+  return p;
+}
+
+uint8_t* new_space(int size) {
+  size_t len = size;
+  uint8_t *p = alloc_space(&len);
+#ifndef CONFIG_TARGET_AM
+  int ret = mprotect(p, len, PROT_READ | PROT_WRITE);
+  Assert(ret == 0, "Can not commit device memory");
+  if (len >= HUGE_PAGE_SIZE) madvise(p, len, MADV_HUGEPAGE);
+#endif
+  return p;
+}
+
+#ifndef CONFIG_TARGET_AM
+uint8_t* new_shared_space(const char *name, int size, int *fd) {
+  size_t len = size;
+  uint8_t *p = alloc_space(&len);
+  *fd = memfd_create(name, MFD_CLOEXEC);
+  Assert(*fd != -1, "Can not create memfd for %s", name);
+  int ret = ftruncate(*fd, len);
+  Assert(ret == 0, "Can not set the size of memfd for %s", name);
+  void *q = mmap(p, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, *fd, 0);
+  Assert(q == p, "Can not map memfd for %s", name);
   return p;
 }
+#endif
 
 static void check_bound(IOMap *map, paddr_t addr) {
   if (map == NULL) {
@@ -47,8 +88,14 @@ static void invoke_callback(io_callback_t c, paddr_t offset, int len, bool is_wr
 }
 
 void init_map() {
+#ifdef CONFIG_TARGET_AM
   io_space = malloc(IO_SPACE_MAX);
   assert(io_space);
+#else
+  io_space = mmap(NULL, IO_SPACE_MAX, PROT_NONE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  Assert(io_space != MAP_FAILED, "Can not reserve address space for device memory");
+#endif
   p_space = io_space;
 }
 
@@ -15,11 +15,10 @@
 
 #include <device/map.h>
 #include <memory/paddr.h>
+#include <device/perf.h>
 
-#define NR_MAP 16
-
-static IOMap maps[NR_MAP] = {};
-static int nr_map = 0;
+static IOMap *maps = NULL;
+static int nr_map = 0, max_map = 0;
 
 static IOMap* fetch_mmio_map(paddr_t addr) {
   int mapid = find_mapid_by_addr(maps, nr_map, addr);
@@ -34,7 +33,11 @@ static void report_mmio_overlap(const char *name1, paddr_t l1, paddr_t r1,
 
 /* device interface */
 void add_mmio_map(const char *name, paddr_t addr, void *space, uint32_t len, io_callback_t callback) {
-  assert(nr_map < NR_MAP);
+  if (nr_map == max_map) {
+    max_map = (max_map == 0 ? 16 : max_map * 2);
+    maps = realloc(maps, max_map * sizeof(maps[0]));
+    assert(maps);
+  }
   paddr_t left = addr, right = addr + len - 1;
   if (in_pmem(left) || in_pmem(right)) {
     report_mmio_overlap(name, left, right, "pmem", PMEM_LEFT, PMEM_RIGHT);
@@ -53,11 +56,18 @@ void add_mmio_map(const char *name, paddr_t addr, void *space, uint32_t len, io_
   nr_map ++;
 }
 
+const IOMap* get_mmio_maps(int *nr) {
+  *nr = nr_map;
+  return maps;
+}
+
 /* bus interface */
 word_t mmio_read(paddr_t addr, int len) {
+  perf_inc(PERF_MMIO_READ);
   return map_read(addr, len, fetch_mmio_map(addr));
 }
 
 void mmio_write(paddr_t addr, int len, word_t data) {
+  perf_inc(PERF_MMIO_WRITE);
   map_write(addr, len, data, fetch_mmio_map(addr));
 }
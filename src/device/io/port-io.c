@@ -13,18 +13,31 @@
 * See the Mulan PSL v2 for more details.
 ***************************************************************************************/
 
+#include <isa.h>
 #include <device/map.h>
+#include <device/perf.h>
 
-#define PORT_IO_SPACE_MAX 65535
+#define PORT_IO_SPACE_MAX 65536
 
-#define NR_MAP 16
-static IOMap maps[NR_MAP] = {};
-static int nr_map = 0;
+static IOMap *maps = NULL;
+static int nr_map = 0, max_map = 0;
+// index of the map containing each port plus 1, 0 means no map
+static uint16_t port2map[PORT_IO_SPACE_MAX] = {};
 
 /* device interface */
 void add_pio_map(const char *name, ioaddr_t addr, void *space, uint32_t len, io_callback_t callback) {
-  assert(nr_map < NR_MAP);
-  assert(addr + len <= PORT_IO_SPACE_MAX);
+  assert(len > 0 && addr + len <= PORT_IO_SPACE_MAX);
+  if (nr_map == max_map) {
+    max_map = (max_map == 0 ? 16 : max_map * 2);
+    maps = realloc(maps, max_map * sizeof(maps[0]));
+    assert(maps);
+  }
+  uint32_t i;
+  for (i = addr; i < addr + len; i ++) {
+    Assert(port2map[i] == 0, "port-io map '%s' is overlapped with '%s' at port " FMT_PADDR,
+        name, maps[port2map[i] - 1].name, (paddr_t)i);
+    port2map[i] = nr_map + 1;
+  }
   maps[nr_map] = (IOMap){ .name = name, .low = addr, .high = addr + len - 1,
     .space = space, .callback = callback };
   Log("Add port-io map '%s' at [" FMT_PADDR ", " FMT_PADDR "]",
@@ -33,17 +46,20 @@ void add_pio_map(const char *name, ioaddr_t addr, void *space, uint32_t len, io_
   nr_map ++;
 }
 
+static inline IOMap* fetch_pio_map(ioaddr_t addr) {
+  int id = port2map[addr];
+  Assert(id != 0, "port " FMT_PADDR " is not mapped at pc = " FMT_WORD, (paddr_t)addr, cpu.pc);
+  difftest_skip_ref();
+  return &maps[id - 1];
+}
+
 /* CPU interface */
 uint32_t pio_read(ioaddr_t addr, int len) {
-  assert(addr + len - 1 < PORT_IO_SPACE_MAX);
-  int mapid = find_mapid_by_addr(maps, nr_map, addr);
-  assert(mapid != -1);
-  return map_read(addr, len, &maps[mapid]);
+  perf_inc(PERF_PIO_READ);
+  return map_read(addr, len, fetch_pio_map(addr));
 }
 
 void pio_write(ioaddr_t addr, int len, uint32_t data) {
-  assert(addr + len - 1 < PORT_IO_SPACE_MAX);
-  int mapid = find_mapid_by_addr(maps, nr_map, addr);
-  assert(mapid != -1);
-  map_write(addr, len, data, &maps[mapid]);
+  perf_inc(PERF_PIO_WRITE);
+  map_write(addr, len, data, fetch_pio_map(addr));
 }
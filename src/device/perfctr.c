@@ -0,0 +1,44 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <device/map.h>
+#include <device/perf.h>
+
+// Each counter occupies 8 bytes. Reading the low 4 bytes latches the whole
+// counter, so the high 4 bytes read later are consistent with it.
+
+uint64_t perf_cnt[NR_PERF] = {};
+static uint64_t *perf_base = NULL;
+
+uint64_t perf_read(int idx) {
+  extern uint64_t g_nr_guest_inst;
+  uint64_t clint_mtime();
+  switch (idx) {
+    case PERF_INSTRET: return g_nr_guest_inst;
+    // follow mtime of CLINT if any, so that both clocks agree
+    case PERF_TIME_US: return MUXDEF(CONFIG_HAS_CLINT, clint_mtime(), get_time());
+    default: return perf_cnt[idx];
+  }
+}
+
+static void perf_io_handler(uint32_t offset, int len, bool is_write) {
+  if (is_write || offset % 8 != 0) return;
+  perf_base[offset / 8] = perf_read(offset / 8);
+}
+
+void init_perfctr() {
+  perf_base = (uint64_t *)new_space(NR_PERF * sizeof(uint64_t));
+  add_mmio_map("perfctr", CONFIG_PERFCTR_MMIO, perf_base, NR_PERF * sizeof(uint64_t), perf_io_handler);
+}
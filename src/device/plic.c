@@ -0,0 +1,110 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <isa.h>
+#include <device/map.h>
+#include <device/intr.h>
+
+// RISC-V platform-level interrupt controller with a single hart. Context 0
+// is for M-mode and context 1 is for S-mode. The interrupt sources are the
+// interrupt lines of devices set by dev_set_irq().
+
+#define NR_CTX 2
+
+#define PLIC_PRIORITY  0x000000
+#define PLIC_PENDING   0x001000
+#define PLIC_ENABLE    0x002000
+#define PLIC_ENABLE_STRIDE  0x80
+#define PLIC_CONTEXT   0x200000
+#define PLIC_CONTEXT_STRIDE 0x1000
+#define PLIC_SIZE (PLIC_CONTEXT + NR_CTX * PLIC_CONTEXT_STRIDE)
+
+static uint8_t *plic_base = NULL;
+static uint32_t *priority = NULL;
+static uint32_t *pending = NULL;
+// sources claimed and not yet completed, which are blocked by the gateway
+static uint32_t claimed = 0;
+static const int ctx_intr[NR_CTX] = { IRQ_M_EXT, IRQ_S_EXT };
+
+static inline uint32_t* enable(int ctx) {
+  return (uint32_t *)(plic_base + PLIC_ENABLE + ctx * PLIC_ENABLE_STRIDE);
+}
+
+static inline uint32_t* context(int ctx) {
+  // [0] is threshold, [1] is claim/complete
+  return (uint32_t *)(plic_base + PLIC_CONTEXT + ctx * PLIC_CONTEXT_STRIDE);
+}
+
+// return the pending and enabled source with the highest priority
+// above the threshold, or 0 if there is none
+static int plic_best(int ctx) {
+  uint32_t candidate = *pending & *enable(ctx);
+  uint32_t max = context(ctx)[0];
+  int best = 0;
+  while (candidate != 0) {
+    int irq = __builtin_ctz(candidate);
+    candidate &= candidate - 1;
+    if (priority[irq] > max) { max = priority[irq]; best = irq; }
+  }
+  return best;
+}
+
+void plic_update() {
+  if (plic_base == NULL) return;
+  *pending = dev_irq_lines & ~claimed;
+  int ctx;
+  for (ctx = 0; ctx < NR_CTX; ctx ++) {
+    dev_set_intr_pending(ctx_intr[ctx], plic_best(ctx) != 0);
+  }
+}
+
+static void plic_io_handler(uint32_t offset, int len, bool is_write) {
+  // the registers are 32-bit, other accesses are applied to the register containing them
+  if (len != 4) {
+    Log("plic: %d-byte %s at offset 0x%x", len, (is_write ? "write" : "read"), offset);
+    offset &= ~3u;
+  }
+  if (offset < PLIC_PENDING) {
+    if (is_write) priority[offset / 4] &= 0x7;
+  } else if (offset >= PLIC_CONTEXT) {
+    int ctx = (offset - PLIC_CONTEXT) / PLIC_CONTEXT_STRIDE;
+    uint32_t reg = (offset - PLIC_CONTEXT) % PLIC_CONTEXT_STRIDE;
+    uint32_t *claim = &context(ctx)[1];
+    if (reg == 4) {
+      if (is_write) {
+        // complete
+        if (*claim < NR_IRQ && (*enable(ctx) & (1u << *claim))) claimed &= ~(1u << *claim);
+      } else {
+        *claim = plic_best(ctx);
+        if (*claim != 0) claimed |= 1u << *claim;
+      }
+    }
+  }
+  // source 0 does not exist, and pending is read-only,
+  // which is recomputed by plic_update()
+  priority[0] = 0;
+  *pending &= ~1u;
+  int ctx;
+  for (ctx = 0; ctx < NR_CTX; ctx ++) *enable(ctx) &= ~1u;
+  plic_update();
+}
+
+void init_plic() {
+  plic_base = new_space(PLIC_SIZE);
+  memset(plic_base, 0, PLIC_SIZE);
+  priority = (uint32_t *)(plic_base + PLIC_PRIORITY);
+  pending = (uint32_t *)(plic_base + PLIC_PENDING);
+  add_mmio_map("plic", CONFIG_PLIC_MMIO, plic_base, PLIC_SIZE, plic_io_handler);
+}
@@ -13,7 +13,15 @@
 * See the Mulan PSL v2 for more details.
 ***************************************************************************************/
 
+#include <utils.h>
 #include <device/map.h>
+#include <memory/paddr.h>
+#include <memory/vaddr.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "mmc.h"
 
 // http://www.files.e-shop.co.il/pdastore/Tech-mmc-samsung/SEC%20MMC%20SPEC%20ver09.pdf
@@ -27,32 +35,213 @@
 #define MULT (1 << (C_SIZE_MULT + 2))
 #define C_SIZE (NR_BLOCK / MULT - 1)
 
+#define SECTOR_SIZE 512
+
 // This is a simple hardware implementation of linux/drivers/mmc/host/bcm2835.c
-// No DMA and IRQ is supported, so the driver must be modified to start PIO
+// No IRQ is supported, so the driver must be modified to start PIO
 // right after sending the actual read/write commands.
+//
+// Besides PIO through SDDATA, a simple DMA is provided with the otherwise
+// unused register at offset 0x24 (SDDMA). If SDDMA is non-zero when a
+// read/write command is sent, the whole transfer of SDHBCT * SDHBLC bytes
+// is performed between the card and guest memory at SDDMA at once, and
+// SDDMA is cleared to notify the completion. If the memory range is
+// invalid, nothing is transferred and SDHSTS_FIFO_ERROR is set in SDHSTS.
+
+#define SDHSTS_FIFO_ERROR 0x08
 
 enum {
   SDCMD, SDARG, SDTOUT, SDCDIV,
   SDRSP0, SDRSP1, SDRSP2, SDRSP3,
-  SDHSTS, __PAD0, __PAD1, __PAD2,
+  SDHSTS, SDDMA, __PAD1, __PAD2,
   SDVDD, SDEDM, SDHCFG, SDHBCT,
   SDDATA, __PAD10, __PAD11, __PAD12,
   SDHBLC
 };
 
-static FILE *fp = NULL;
+static uint8_t *img = NULL;
+static uint64_t img_size = 0;
 static uint32_t *base = NULL;
 static uint32_t blkcnt = 0;
-static long blk_addr = 0;
+static uint64_t blk_addr = 0;
 static uint32_t addr = 0;
 static bool write_cmd = 0;
 static bool read_ext_csd = false;
 
+// Copy-on-write overlay of the image. The image is then opened read-only
+// and can be shared by multiple NEMU instances. The first write to a sector
+// copies it to the overlay, and later accesses to this sector are served
+// by the overlay. The overlay file is laid out as
+//   [ header (1 page) | allocation bitmap | sectors (sparse) ]
+// where the i-th sector is stored at the i-th slot of the sector area,
+// so the file only occupies the disk space of the sectors written.
+#define OVL_MAGIC "NEMUCOW1"
+
+typedef struct {
+  char magic[8];
+  uint64_t img_size;
+  uint64_t sector_size;
+  uint64_t bitmap_offset;
+  uint64_t data_offset;
+} OverlayHeader;
+
+static const char *ovl_path = CONFIG_SDCARD_OVERLAY_PATH;
+static int img_fd = -1, ovl_fd = -1;
+static OverlayHeader *ovl = NULL;
+static uint64_t *ovl_bitmap = NULL;
+static uint8_t *ovl_data = NULL;
+
+static inline bool ovl_test(uint64_t sec) {
+  return (ovl_bitmap[sec / 64] >> (sec % 64)) & 1;
+}
+
+static inline void ovl_set(uint64_t sec) {
+  ovl_bitmap[sec / 64] |= 1ull << (sec % 64);
+}
+
+// return the host address of the byte at `pos` of the image,
+// the rest of the sector containing it is also accessible
+static uint8_t* img_ptr(uint64_t pos, bool is_write) {
+  if (pos >= img_size) return NULL;
+  if (ovl == NULL) return img + pos;
+
+  uint64_t sec = pos / SECTOR_SIZE;
+  uint8_t *p = ovl_data + sec * SECTOR_SIZE;
+  if (!ovl_test(sec)) {
+    if (!is_write) return img + pos;
+    uint64_t sec_start = sec * SECTOR_SIZE;
+    uint64_t len = img_size - sec_start;
+    memcpy(p, img + sec_start, (len < SECTOR_SIZE ? len : SECTOR_SIZE));
+    ovl_set(sec);
+  }
+  return p + pos % SECTOR_SIZE;
+}
+
+// Copy `len` bytes at `pos` of the image, which do not cross a sector.
+// The bytes beyond the end of the image are read as zero, and the writes
+// to them are dropped.
+static void img_rw(uint64_t pos, void *buf, uint64_t len, bool is_write) {
+  uint8_t *p = img_ptr(pos, is_write);
+  uint64_t n = (p == NULL ? 0 : (img_size - pos < len ? img_size - pos : len));
+  if (n > 0) {
+    if (is_write) memcpy(p, buf, n);
+    else memcpy(buf, p, n);
+  }
+  if (!is_write) memset((uint8_t *)buf + n, 0, len - n);
+}
+
+// set by --sd-overlay, overriding SDCARD_OVERLAY_PATH
+void sdcard_set_overlay(const char *path) {
+  ovl_path = path;
+}
+
+#ifdef CONFIG_SDCARD_OVERLAY_COMMIT
+// write the sectors in the overlay back to the image, then empty the overlay
+static void overlay_commit() {
+  const char *path = CONFIG_SDCARD_IMG_PATH;
+  if (is_exit_status_bad()) {
+    Log("NEMU exits with error, the overlay is not committed to sdcard image %s", path);
+    return;
+  }
+  // other instances hold shared locks of the image while they are running
+  if (flock(img_fd, LOCK_EX | LOCK_NB) != 0) {
+    Log("sdcard image %s is used by other instances, the overlay is not committed", path);
+    return;
+  }
+  int fd = open(path, O_WRONLY);
+  Assert(fd != -1, "Can not open sdcard image %s to commit the overlay", path);
+  uint64_t nr_sec = (img_size + SECTOR_SIZE - 1) / SECTOR_SIZE;
+  uint64_t sec, nr_commit = 0;
+  for (sec = 0; sec < nr_sec; sec ++) {
+    if (!ovl_test(sec)) continue;
+    // merge continuous sectors into a single write
+    uint64_t end = sec + 1;
+    while (end < nr_sec && ovl_test(end)) end ++;
+    uint64_t off = sec * SECTOR_SIZE;
+    uint64_t len = (end * SECTOR_SIZE < img_size ? end * SECTOR_SIZE : img_size) - off;
+    ssize_t ret = pwrite(fd, ovl_data + off, len, off);
+    Assert(ret == len, "Can not commit the overlay to sdcard image %s", path);
+    nr_commit += end - sec;
+    sec = end;
+  }
+  fsync(fd);
+  close(fd);
+
+  memset(ovl_bitmap, 0, ovl->data_offset - ovl->bitmap_offset);
+  // release the disk space of the sectors by truncating and re-extending the file
+  __attribute__((unused)) int ret;
+  ret = ftruncate(ovl_fd, ovl->data_offset);
+  ret = ftruncate(ovl_fd, ovl->data_offset + nr_sec * SECTOR_SIZE);
+  Log("Commit %" PRIu64 " sectors of the overlay to sdcard image %s", nr_commit, path);
+}
+#endif
+
+static void init_overlay(const char *path) {
+  int fd = open(path, O_RDWR | O_CREAT, 0644);
+  Assert(fd != -1, "Can not open sdcard overlay: %s", path);
+  // the lock is held until NEMU exits
+  int ret = flock(fd, LOCK_EX | LOCK_NB);
+  Assert(ret == 0, "sdcard overlay %s is used by another instance, give each one a different overlay with --sd-overlay", path);
+
+  uint64_t nr_sec = (img_size + SECTOR_SIZE - 1) / SECTOR_SIZE;
+  uint64_t bitmap_size = ROUNDUP((nr_sec + 63) / 64 * 8, PAGE_SIZE);
+  OverlayHeader hdr = {
+    .magic = OVL_MAGIC, .img_size = img_size, .sector_size = SECTOR_SIZE,
+    .bitmap_offset = PAGE_SIZE, .data_offset = PAGE_SIZE + bitmap_size,
+  };
+  uint64_t file_size = hdr.data_offset + nr_sec * SECTOR_SIZE;
+
+  struct stat st;
+  ret = fstat(fd, &st);
+  assert(ret == 0);
+  bool is_new = (st.st_size == 0);
+  if (is_new) {
+    // sparse file, the disk space is allocated on write
+    ret = ftruncate(fd, file_size);
+    Assert(ret == 0, "Can not create sdcard overlay: %s", path);
+  } else {
+    Assert(st.st_size == file_size, "Size of sdcard overlay %s does not match the image", path);
+  }
+
+  ovl = mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  Assert(ovl != MAP_FAILED, "Can not mmap sdcard overlay: %s", path);
+  ovl_fd = fd;
+
+  if (is_new) *ovl = hdr;
+  else Assert(memcmp(ovl, &hdr, sizeof(hdr)) == 0,
+      "sdcard overlay %s does not match the image", path);
+
+  ovl_bitmap = (uint64_t *)((uint8_t *)ovl + ovl->bitmap_offset);
+  ovl_data = (uint8_t *)ovl + ovl->data_offset;
+  Log("sdcard overlay is %s", path);
+
+  IFDEF(CONFIG_SDCARD_OVERLAY_COMMIT, atexit(overlay_commit));
+}
+
+static void sdcard_dma(bool is_write) {
+  paddr_t dma_addr = base[SDDMA];
+  uint64_t nbyte = (uint64_t)base[SDHBCT] * base[SDHBLC];
+  base[SDDMA] = 0;
+  if (nbyte == 0 || !in_pmem(dma_addr) || nbyte > PMEM_RIGHT - dma_addr + 1) {
+    Log("invalid sdcard DMA request [" FMT_PADDR ", +%" PRIu64 ")", dma_addr, nbyte);
+    base[SDHSTS] |= SDHSTS_FIFO_ERROR;
+    return;
+  }
+  uint8_t *buf = guest_to_host(dma_addr);
+  uint64_t pos = blk_addr * SECTOR_SIZE;
+  uint64_t i;
+  for (i = 0; i < nbyte; i += SECTOR_SIZE) {
+    uint64_t len = (nbyte - i < SECTOR_SIZE ? nbyte - i : SECTOR_SIZE);
+    img_rw(pos + i, buf + i, len, is_write);
+  }
+  if (!is_write) difftest_dma_write(dma_addr, nbyte);
+}
+
 static void prepare_rw(int is_write) {
   blk_addr = base[SDARG];
   addr = 0;
-  if (fp) fseek(fp, blk_addr << 9, SEEK_SET);
   write_cmd = is_write;
+  if (base[SDDMA] != 0) sdcard_dma(is_write);
 }
 
 static void sdcard_handle_cmd(int cmd) {
@@ -93,11 +282,16 @@ static void sdcard_io_handler(uint32_t offset, int len, bool is_write) {
   switch (idx) {
     case SDCMD: sdcard_handle_cmd(base[SDCMD] & 0x3f); break;
     case SDARG:
+    case SDDMA:
+    case SDHBCT:
+    case SDHBLC:
     case SDRSP0:
     case SDRSP1:
     case SDRSP2:
     case SDRSP3:
       break;
+    // the bits are cleared by writing 1, and the error bit is the only one
+    case SDHSTS: if (is_write) base[SDHSTS] = 0; break;
     case SDDATA:
        if (read_ext_csd) {
          // See section 8.1 JEDEC Standard JED84-A441
@@ -109,10 +303,8 @@ static void sdcard_io_handler(uint32_t offset, int len, bool is_write) {
          }
          base[SDDATA] = data;
          if (addr == 512 - 4) read_ext_csd = false;
-       } else if (fp) {
-         __attribute__((unused)) int ret;
-         if (!write_cmd) { ret = fread(&base[SDDATA], 4, 1, fp); }
-         else { ret = fwrite(&base[SDDATA], 4, 1, fp); }
+       } else {
+         img_rw(blk_addr * SECTOR_SIZE + addr, &base[SDDATA], 4, write_cmd);
        }
        addr += 4;
        break;
@@ -128,7 +320,28 @@ void init_sdcard() {
 
   Assert(C_SIZE < (1 << 12), "shoule be fit in 12 bits");
 
-  const char *img = CONFIG_SDCARD_IMG_PATH;
-  fp = fopen(img, "r+");
-  if (fp == NULL) Log("Can not find sdcard image: %s", img);
+  const char *path = CONFIG_SDCARD_IMG_PATH;
+  bool has_ovl = (ovl_path[0] != '\0');
+  int fd = open(path, (has_ovl ? O_RDONLY : O_RDWR));
+  if (fd == -1) { Log("Can not find sdcard image: %s", path); return; }
+
+  struct stat st;
+  int ret = fstat(fd, &st);
+  assert(ret == 0);
+  img_size = st.st_size;
+  if (img_size > 0) {
+    // map the image to avoid file I/O for every access to SDDATA
+    img = mmap(NULL, img_size, PROT_READ | (has_ovl ? 0 : PROT_WRITE), MAP_SHARED, fd, 0);
+    Assert(img != MAP_FAILED, "Can not mmap sdcard image: %s", path);
+  }
+  Log("sdcard image is %s, size = %" PRIu64, path, img_size);
+
+  if (has_ovl && img_size > 0) {
+    // keep the image open to hold a shared lock, see overlay_commit()
+    flock(fd, LOCK_SH);
+    img_fd = fd;
+    init_overlay(ovl_path);
+  } else {
+    close(fd);
+  }
 }
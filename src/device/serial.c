@@ -13,39 +13,242 @@
 * See the Mulan PSL v2 for more details.
 ***************************************************************************************/
 
+#define _GNU_SOURCE // for pty
 #include <utils.h>
 #include <device/map.h>
+#include <device/intr.h>
+#ifndef CONFIG_TARGET_AM
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <termios.h>
+#endif
 
 /* http://en.wikibooks.org/wiki/Serial_Programming/8250_UART_Programming */
 // NOTE: this is compatible to 16550
 
-#define CH_OFFSET 0
+enum {
+  UART_RX = 0,  // receive buffer (read), transmit holding (write), DLL (DLAB = 1)
+  UART_IER,     // interrupt enable, DLM (DLAB = 1)
+  UART_IIR,     // interrupt identification (read), FIFO control (write)
+  UART_LCR,     // line control
+  UART_MCR,     // modem control
+  UART_LSR,     // line status
+  UART_MSR,     // modem status
+  UART_SCR,     // scratch
+  NR_REG
+};
+
+#define IER_RDI   0x01  // receive data available
+#define IER_THRI  0x02  // transmit holding register empty
+#define IIR_NO_INT 0x01
+#define IIR_THRI  0x02
+#define IIR_RDI   0x04
+#define IIR_CTI   0x0c  // character timeout
+#define IIR_FIFO  0xc0
+#define FCR_FIFO_ENABLE 0x01
+#define FCR_CLEAR_RX    0x02
+#define LCR_DLAB  0x80
+#define MCR_LOOP  0x10
+#define LSR_DR    0x01  // data ready
+#define LSR_THRE  0x20
+#define LSR_TEMT  0x40
+#define MSR_CTS   0x10
+#define MSR_DSR   0x20
+#define MSR_DCD   0x80
+
+#define RX_FIFO_LEN 16
 
 static uint8_t *serial_base = NULL;
+static uint8_t ier = 0, fcr = 0, lcr = 0, mcr = 0, scr = 0;
+static uint8_t dll = 0, dlm = 0;
+static bool thr_ipending = false;
+
+static uint8_t rx_fifo[RX_FIFO_LEN] = {};
+static int rx_f = 0, rx_n = 0;
+
+static void rx_enqueue(uint8_t ch) {
+  if (rx_n == RX_FIFO_LEN) return; // overrun, drop it
+  rx_fifo[(rx_f + rx_n) % RX_FIFO_LEN] = ch;
+  rx_n ++;
+}
 
+static uint8_t rx_dequeue() {
+  if (rx_n == 0) return 0;
+  uint8_t ch = rx_fifo[rx_f];
+  rx_f = (rx_f + 1) % RX_FIFO_LEN;
+  rx_n --;
+  return ch;
+}
+
+static int rx_trigger_level() {
+  static const int level[] = { 1, 4, 8, 14 };
+  return (fcr & FCR_FIFO_ENABLE) ? level[fcr >> 6] : 1;
+}
+
+static uint8_t serial_iir() {
+  uint8_t iir = IIR_NO_INT;
+  if ((ier & IER_RDI) && rx_n > 0) iir = (rx_n >= rx_trigger_level() ? IIR_RDI : IIR_CTI);
+  else if ((ier & IER_THRI) && thr_ipending) iir = IIR_THRI;
+  return iir | ((fcr & FCR_FIFO_ENABLE) ? IIR_FIFO : 0);
+}
+
+static void serial_update_irq() {
+  dev_set_irq(CONFIG_SERIAL_IRQ, !(serial_iir() & IIR_NO_INT));
+}
+
+#ifdef CONFIG_TARGET_AM
+static void serial_putc(char ch) { putch(ch); }
+static void serial_flush() { }
+#else
+// The output is batched to avoid the cost of a system call and stdio
+// locking for every character. It is flushed on newline, at every tick
+// of the device timer (see serial_update()) and on exit. What can not be
+// written now is kept and retried at the next tick.
+#define OUT_BUF_LEN 4096
+static char out_buf[OUT_BUF_LEN];
+static int out_len = 0;
+static int out_fd = STDERR_FILENO;
+static int in_fd = -1;
+
+static void serial_flush() {
+  int i = 0;
+  while (i < out_len) {
+    int ret = write(out_fd, out_buf + i, out_len - i);
+    if (ret > 0) i += ret;
+    else if (ret == -1 && errno == EINTR) continue;
+    else break;
+  }
+  out_len -= i;
+  if (i > 0 && out_len > 0) memmove(out_buf, out_buf + i, out_len);
+}
 
 static void serial_putc(char ch) {
-  MUXDEF(CONFIG_TARGET_AM, putch(ch), putc(ch, stderr));
+  if (out_len == OUT_BUF_LEN) return; // the host does not take the output, drop it
+  out_buf[out_len ++] = ch;
+  if (ch == '\n' || out_len == OUT_BUF_LEN) serial_flush();
 }
 
-static void serial_io_handler(uint32_t offset, int len, bool is_write) {
-  assert(len == 1);
+// Move the available input from host to the receive FIFO without blocking.
+// This is called at every tick, so that reading LSR does not need a system call.
+static void serial_poll_input() {
+  if (in_fd == -1 || rx_n == RX_FIFO_LEN) return;
+  struct pollfd pfd = { .fd = in_fd, .events = POLLIN };
+  if (poll(&pfd, 1, 0) <= 0 || !(pfd.revents & POLLIN)) return;
+  uint8_t buf[RX_FIFO_LEN];
+  int ret = read(in_fd, buf, RX_FIFO_LEN - rx_n);
+  int i;
+  for (i = 0; i < ret; i ++) rx_enqueue(buf[i]);
+  if (ret > 0) serial_update_irq();
+}
+
+static void init_serial_input() {
+#if defined(CONFIG_SERIAL_INPUT_FIFO)
+  const char *path = "/tmp/nemu.serial";
+  if (access(path, F_OK) != 0) {
+    int ret = mkfifo(path, 0666);
+    Assert(ret == 0, "Can not create FIFO %s", path);
+  }
+  // open for writing as well, so that the FIFO never sees EOF
+  in_fd = open(path, O_RDWR | O_NONBLOCK);
+  Assert(in_fd != -1, "Can not open FIFO %s", path);
+  Log("Serial input is from FIFO %s", path);
+#elif defined(CONFIG_SERIAL_INPUT_PTY)
+  in_fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+  Assert(in_fd != -1 && grantpt(in_fd) == 0 && unlockpt(in_fd) == 0, "Can not create pty");
+  struct termios t;
+  if (tcgetattr(in_fd, &t) == 0) {
+    cfmakeraw(&t);
+    tcsetattr(in_fd, TCSANOW, &t);
+  }
+  out_fd = in_fd;
+  Log("Serial is connected to %s", ptsname(in_fd));
+#elif defined(CONFIG_SERIAL_INPUT_STDIN)
+  in_fd = STDIN_FILENO;
+  Log("Serial input is from stdin");
+#endif
+}
+#endif
+
+void serial_update() {
+  serial_flush();
+  IFNDEF(CONFIG_TARGET_AM, serial_poll_input());
+}
+
+static void serial_write(uint32_t offset, uint8_t data) {
+  bool dlab = (lcr & LCR_DLAB) != 0;
+  switch (offset) {
+    case UART_RX:
+      if (dlab) { dll = data; break; }
+      if (mcr & MCR_LOOP) rx_enqueue(data);
+      else serial_putc(data);
+      thr_ipending = true;
+      break;
+    case UART_IER:
+      if (dlab) { dlm = data; break; }
+      ier = data & 0x0f;
+      // the transmitter is always empty
+      if (ier & IER_THRI) thr_ipending = true;
+      break;
+    case UART_IIR:
+      fcr = data & 0xc9;
+      if (data & FCR_CLEAR_RX) rx_f = rx_n = 0;
+      break;
+    case UART_LCR: lcr = data; break;
+    case UART_MCR: mcr = data & 0x1f; break;
+    case UART_SCR: scr = data; break;
+    default: break; // LSR and MSR are read-only
+  }
+  serial_update_irq();
+}
+
+static uint8_t serial_read(uint32_t offset) {
+  bool dlab = (lcr & LCR_DLAB) != 0;
+  uint8_t ret = 0;
   switch (offset) {
-    /* We bind the serial port with the host stderr in NEMU. */
-    case CH_OFFSET:
-      if (is_write) serial_putc(serial_base[0]);
-      else panic("do not support read");
+    case UART_RX:
+      if (dlab) return dll;
+      ret = rx_dequeue();
       break;
-    default: panic("do not support offset = %d", offset);
+    case UART_IER: return dlab ? dlm : ier;
+    case UART_IIR:
+      ret = serial_iir();
+      if ((ret & 0x0f) == IIR_THRI) thr_ipending = false;
+      break;
+    case UART_LCR: return lcr;
+    case UART_MCR: return mcr;
+    case UART_LSR:
+      return LSR_THRE | LSR_TEMT | (rx_n > 0 ? LSR_DR : 0);
+    case UART_MSR:
+      if (mcr & MCR_LOOP) {
+        // DTR -> DSR, RTS -> CTS, OUT1 -> RI, OUT2 -> DCD
+        return ((mcr & 0x01) << 5) | ((mcr & 0x02) << 3) | ((mcr & 0x0c) << 4);
+      }
+      return MSR_DCD | MSR_DSR | MSR_CTS;
+    case UART_SCR: return scr;
   }
+  serial_update_irq();
+  return ret;
+}
+
+static void serial_io_handler(uint32_t offset, int len, bool is_write) {
+  assert(len == 1 && offset < NR_REG);
+  if (is_write) serial_write(offset, serial_base[offset]);
+  else serial_base[offset] = serial_read(offset);
 }
 
 void init_serial() {
-  serial_base = new_space(8);
+  serial_base = new_space(NR_REG);
 #ifdef CONFIG_HAS_PORT_IO
-  add_pio_map ("serial", CONFIG_SERIAL_PORT, serial_base, 8, serial_io_handler);
+  add_pio_map ("serial", CONFIG_SERIAL_PORT, serial_base, NR_REG, serial_io_handler);
 #else
-  add_mmio_map("serial", CONFIG_SERIAL_MMIO, serial_base, 8, serial_io_handler);
+  add_mmio_map("serial", CONFIG_SERIAL_MMIO, serial_base, NR_REG, serial_io_handler);
 #endif
 
+#ifndef CONFIG_TARGET_AM
+  init_serial_input();
+  atexit(serial_flush);
+#endif
 }
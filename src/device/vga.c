@@ -15,6 +15,10 @@
 
 #include <common.h>
 #include <device/map.h>
+#include <memory/paddr.h>
+#ifdef CONFIG_VGA_SHARE_VMEM
+#include <unistd.h>
+#endif
 
 #define SCREEN_W (MUXDEF(CONFIG_VGA_SIZE_800x600, 800, 400))
 #define SCREEN_H (MUXDEF(CONFIG_VGA_SIZE_800x600, 600, 300))
@@ -76,6 +80,115 @@ void vga_update_screen() {
   // then zero out the sync register
 }
 
+#ifdef CONFIG_VGA_BLITTER
+// 2D blitter operating on the frame buffer, which is started by writing
+// BLT_CMD. The coordinates are in pixels of the screen. Rectangles out of
+// the screen or the guest memory are rejected with BLT_STATUS set to 1.
+enum {
+  BLT_CMD, BLT_DST_X, BLT_DST_Y, BLT_W, BLT_H,
+  BLT_SRC_X, BLT_SRC_Y,   // for copy
+  BLT_COLOR,              // for fill, in ARGB8888
+  BLT_SRC_ADDR, BLT_SRC_PITCH, BLT_SRC_FMT, // for blit from the guest memory
+  BLT_STATUS,
+  NR_BLT_REG
+};
+
+enum { BLT_CMD_FILL = 1, BLT_CMD_COPY, BLT_CMD_BLIT };
+enum { BLT_FMT_ARGB8888, BLT_FMT_RGB565 };
+
+static uint32_t *blt_base = NULL;
+
+// The row operations are processed in chunks of fixed size,
+// so that they can be vectorized by the compiler with -O2.
+#define BLT_CHUNK 8
+
+static void fill_row(uint32_t *__restrict dst, uint32_t color, int w) {
+  int i = 0, j;
+  for (; i + BLT_CHUNK <= w; i += BLT_CHUNK) {
+    for (j = 0; j < BLT_CHUNK; j ++) dst[i + j] = color;
+  }
+  for (; i < w; i ++) dst[i] = color;
+}
+
+static inline uint32_t rgb565_to_argb8888(uint32_t p) {
+  uint32_t r = (p >> 11) & 0x1f, g = (p >> 5) & 0x3f, b = p & 0x1f;
+  // replicate the high bits to fill the low bits
+  r = (r << 3) | (r >> 2);
+  g = (g << 2) | (g >> 4);
+  b = (b << 3) | (b >> 2);
+  return (r << 16) | (g << 8) | b;
+}
+
+static void rgb565_row(uint32_t *__restrict dst, const uint16_t *__restrict src, int w) {
+  int i = 0, j;
+  for (; i + BLT_CHUNK <= w; i += BLT_CHUNK) {
+    for (j = 0; j < BLT_CHUNK; j ++) dst[i + j] = rgb565_to_argb8888(src[i + j]);
+  }
+  for (; i < w; i ++) dst[i] = rgb565_to_argb8888(src[i]);
+}
+
+static bool in_screen(uint32_t x, uint32_t y, uint32_t w, uint32_t h) {
+  return x <= screen_width() && w <= screen_width() - x &&
+         y <= screen_height() && h <= screen_height() - y;
+}
+
+static bool blt_exec() {
+  uint32_t w = blt_base[BLT_W], h = blt_base[BLT_H];
+  uint32_t dx = blt_base[BLT_DST_X], dy = blt_base[BLT_DST_Y];
+  uint32_t pitch = screen_width();
+  if (!in_screen(dx, dy, w, h)) return false;
+  uint32_t *dst = (uint32_t *)vmem + dy * pitch + dx;
+  int y;
+  switch (blt_base[BLT_CMD]) {
+    case BLT_CMD_FILL:
+      for (y = 0; y < h; y ++) fill_row(dst + y * pitch, blt_base[BLT_COLOR], w);
+      break;
+    case BLT_CMD_COPY: {
+      uint32_t sx = blt_base[BLT_SRC_X], sy = blt_base[BLT_SRC_Y];
+      if (!in_screen(sx, sy, w, h)) return false;
+      uint32_t *src = (uint32_t *)vmem + sy * pitch + sx;
+      // copy from the bottom if the destination is below the source
+      // to handle overlapping, memmove() handles overlapping in a row
+      if (dy > sy) {
+        for (y = h - 1; y >= 0; y --) memmove(dst + y * pitch, src + y * pitch, w * sizeof(uint32_t));
+      } else {
+        for (y = 0; y < h; y ++) memmove(dst + y * pitch, src + y * pitch, w * sizeof(uint32_t));
+      }
+      break;
+    }
+    case BLT_CMD_BLIT: {
+      paddr_t src = blt_base[BLT_SRC_ADDR];
+      uint32_t src_pitch = blt_base[BLT_SRC_PITCH];
+      int bpp = (blt_base[BLT_SRC_FMT] == BLT_FMT_RGB565 ? 2 : 4);
+      if (h == 0 || w == 0) break;
+      uint64_t last = (uint64_t)src_pitch * (h - 1) + (uint64_t)w * bpp;
+      if (!in_pmem(src) || last > CONFIG_MSIZE - (src - CONFIG_MBASE)) return false;
+      for (y = 0; y < h; y ++) {
+        uint8_t *row = guest_to_host(src + y * src_pitch);
+        if (bpp == 2) rgb565_row(dst + y * pitch, (uint16_t *)row, w);
+        else memcpy(dst + y * pitch, row, w * sizeof(uint32_t));
+      }
+      break;
+    }
+    default: return false;
+  }
+  return true;
+}
+
+static void blt_io_handler(uint32_t offset, int len, bool is_write) {
+  assert(len == 4);
+  if (is_write && offset == BLT_CMD * 4) {
+    blt_base[BLT_STATUS] = !blt_exec();
+  }
+}
+
+static void init_blitter() {
+  blt_base = (uint32_t *)new_space(NR_BLT_REG * sizeof(uint32_t));
+  memset(blt_base, 0, NR_BLT_REG * sizeof(uint32_t));
+  add_mmio_map("vgablt", CONFIG_VGA_BLT_MMIO, blt_base, NR_BLT_REG * sizeof(uint32_t), blt_io_handler);
+}
+#endif
+
 void init_vga() {
   vgactl_port_base = (uint32_t *)new_space(8);
   vgactl_port_base[0] = (screen_width() << 16) | screen_height();
@@ -85,8 +198,15 @@ void init_vga() {
   add_mmio_map("vgactl", CONFIG_VGA_CTL_MMIO, vgactl_port_base, 8, NULL);
 #endif
 
+#ifdef CONFIG_VGA_SHARE_VMEM
+  int fd;
+  vmem = new_shared_space("nemu-vmem", screen_size(), &fd);
+  Log("The frame buffer can be mapped from /proc/%d/fd/%d", getpid(), fd);
+#else
   vmem = new_space(screen_size());
+#endif
   add_mmio_map("vmem", CONFIG_FB_ADDR, vmem, screen_size(), NULL);
   IFDEF(CONFIG_VGA_SHOW_SCREEN, init_screen());
   IFDEF(CONFIG_VGA_SHOW_SCREEN, memset(vmem, 0, screen_size()));
+  IFDEF(CONFIG_VGA_BLITTER, init_blitter());
 }
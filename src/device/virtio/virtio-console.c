@@ -0,0 +1,176 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <device/virtio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+// virtio console with a single port. The backend is the standard
+// input/output of NEMU, or a client connected to a Unix socket.
+
+enum { RX_QUEUE, TX_QUEUE, NR_QUEUE };
+
+// the limit of iovecs in a single writev()
+#define TX_MAX_IOV 1024
+
+static VirtioDev dev = {};
+static int in_fd = -1, out_fd = -1;
+static int listen_fd = -1;
+// Descriptor chains popped from the transmit queue but not completely
+// written, since the socket is full. They are retried later.
+static VirtqElem tx_elem[TX_MAX_IOV / VIRTQ_MAX_SEG];
+static int nr_tx = 0;
+static size_t tx_done = 0; // bytes of tx_elem[0] already written
+
+static void console_disconnect() {
+  Log("virtio console: client disconnected");
+  close(in_fd);
+  in_fd = out_fd = -1;
+}
+
+static ssize_t console_write(const struct iovec *iov, int nr_iov) {
+  if (listen_fd == -1) return writev(out_fd, iov, nr_iov);
+  // do not raise SIGPIPE when the client is gone
+  struct msghdr msg = { .msg_iov = (struct iovec *)iov, .msg_iovlen = nr_iov };
+  return sendmsg(out_fd, &msg, MSG_NOSIGNAL);
+}
+
+// Move the guest output to the host. The buffers of all the descriptor
+// chains available are written by a single writev(). A chain is returned
+// to the guest only after it is written completely.
+static void console_tx() {
+  bool pushed = false;
+  while (true) {
+    while (nr_tx < ARRLEN(tx_elem) && virtq_pop(&dev, TX_QUEUE, &tx_elem[nr_tx])) nr_tx ++;
+    if (nr_tx == 0) break;
+
+    struct iovec iov[TX_MAX_IOV];
+    int nr_iov = 0, i, j;
+    size_t skip = tx_done, len = 0;
+    for (i = 0; i < nr_tx; i ++) {
+      for (j = 0; j < tx_elem[i].nr_out; j ++) {
+        struct iovec *v = &tx_elem[i].out[j];
+        if (skip >= v->iov_len) { skip -= v->iov_len; continue; }
+        iov[nr_iov].iov_base = (uint8_t *)v->iov_base + skip;
+        iov[nr_iov].iov_len = v->iov_len - skip;
+        len += iov[nr_iov ++].iov_len;
+        skip = 0;
+      }
+    }
+
+    // the output is dropped if there is no client
+    ssize_t ret = (out_fd == -1 || len == 0 ? len : console_write(iov, nr_iov));
+    if (ret < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) break;
+      if (listen_fd != -1 && (errno == EPIPE || errno == ECONNRESET)) console_disconnect();
+      else Log("virtio console: output is dropped, errno = %d", errno);
+      ret = len;
+    }
+
+    // return the chains written completely
+    tx_done += ret;
+    for (i = 0; i < nr_tx && tx_done >= tx_elem[i].out_len; i ++) {
+      tx_done -= tx_elem[i].out_len;
+      virtq_push(&dev, TX_QUEUE, &tx_elem[i], 0);
+      pushed = true;
+    }
+    nr_tx -= i;
+    memmove(tx_elem, tx_elem + i, nr_tx * sizeof(tx_elem[0]));
+    if (ret < len) break;
+  }
+  if (pushed) virtio_notify(&dev);
+}
+
+static void console_reset(VirtioDev *d) {
+  nr_tx = 0;
+  tx_done = 0;
+}
+
+// move the available host input to the receive buffers without blocking
+static void console_rx() {
+  if (in_fd == -1 || !virtq_ready(&dev, RX_QUEUE)) return;
+  bool pushed = false;
+  VirtqElem e;
+  while (true) {
+    struct pollfd pfd = { .fd = in_fd, .events = POLLIN };
+    if (poll(&pfd, 1, 0) <= 0) break;
+    if (!virtq_pop(&dev, RX_QUEUE, &e)) break;
+    ssize_t ret = readv(in_fd, e.in, e.nr_in);
+    if (ret <= 0) {
+      // give the buffer back unused
+      virtq_push(&dev, RX_QUEUE, &e, 0);
+      pushed = true;
+      if (listen_fd != -1) console_disconnect();
+      else in_fd = -1; // EOF of stdin
+      break;
+    }
+    virtq_push(&dev, RX_QUEUE, &e, ret);
+    pushed = true;
+  }
+  if (pushed) virtio_notify(&dev);
+}
+
+static void console_notify(VirtioDev *d, int q) {
+  if (q == TX_QUEUE) console_tx();
+  else console_rx();
+}
+
+void virtio_console_update() {
+  if (listen_fd != -1 && in_fd == -1) {
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd != -1) {
+      fcntl(fd, F_SETFL, O_NONBLOCK);
+      Log("virtio console: client connected");
+      in_fd = out_fd = fd;
+    }
+  }
+  if (nr_tx > 0) console_tx();
+  console_rx();
+}
+
+static void init_socket(const char *path) {
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  Assert(strlen(path) < sizeof(addr.sun_path), "Path of socket %s is too long", path);
+  strcpy(addr.sun_path, path);
+  listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  Assert(listen_fd != -1, "Can not create socket");
+  unlink(path);
+  int ret = bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr));
+  Assert(ret == 0, "Can not bind socket %s", path);
+  ret = listen(listen_fd, 1);
+  Assert(ret == 0, "Can not listen on socket %s", path);
+  Log("virtio console is listening on %s", path);
+}
+
+void init_virtio_console() {
+  dev.name = "virtio-console";
+  dev.device_id = VIRTIO_ID_CONSOLE;
+  dev.nr_queue = NR_QUEUE;
+  dev.irq = CONFIG_VIRTIO_CONSOLE_IRQ;
+  dev.notify = console_notify;
+  dev.reset = console_reset;
+  virtio_mmio_init(&dev, CONFIG_VIRTIO_CONSOLE_MMIO);
+
+  const char *path = CONFIG_VIRTIO_CONSOLE_SOCKET;
+  if (path[0] != '\0') init_socket(path);
+  else {
+    in_fd = STDIN_FILENO;
+    out_fd = STDOUT_FILENO;
+  }
+}
@@ -0,0 +1,259 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <device/map.h>
+#include <device/intr.h>
+#include <device/virtio.h>
+#include <memory/paddr.h>
+
+#define VIRTIO_MMIO_MAGIC 0x74726976 // "virt"
+#define VIRTIO_MMIO_VENDOR 0x554d454e // "NEMU"
+#define VIRTIO_MMIO_SIZE 0x200
+
+enum {
+  VIRTIO_MMIO_MAGIC_VALUE         = 0x000,
+  VIRTIO_MMIO_VERSION             = 0x004,
+  VIRTIO_MMIO_DEVICE_ID           = 0x008,
+  VIRTIO_MMIO_VENDOR_ID           = 0x00c,
+  VIRTIO_MMIO_DEVICE_FEATURES     = 0x010,
+  VIRTIO_MMIO_DEVICE_FEATURES_SEL = 0x014,
+  VIRTIO_MMIO_DRIVER_FEATURES     = 0x020,
+  VIRTIO_MMIO_DRIVER_FEATURES_SEL = 0x024,
+  VIRTIO_MMIO_QUEUE_SEL           = 0x030,
+  VIRTIO_MMIO_QUEUE_NUM_MAX       = 0x034,
+  VIRTIO_MMIO_QUEUE_NUM           = 0x038,
+  VIRTIO_MMIO_QUEUE_READY         = 0x044,
+  VIRTIO_MMIO_QUEUE_NOTIFY        = 0x050,
+  VIRTIO_MMIO_INTERRUPT_STATUS    = 0x060,
+  VIRTIO_MMIO_INTERRUPT_ACK       = 0x064,
+  VIRTIO_MMIO_STATUS              = 0x070,
+  VIRTIO_MMIO_QUEUE_DESC_LOW      = 0x080,
+  VIRTIO_MMIO_QUEUE_DESC_HIGH     = 0x084,
+  VIRTIO_MMIO_QUEUE_DRIVER_LOW    = 0x090,
+  VIRTIO_MMIO_QUEUE_DRIVER_HIGH   = 0x094,
+  VIRTIO_MMIO_QUEUE_DEVICE_LOW    = 0x0a0,
+  VIRTIO_MMIO_QUEUE_DEVICE_HIGH   = 0x0a4,
+  VIRTIO_MMIO_CONFIG_GENERATION   = 0x0fc,
+  VIRTIO_MMIO_CONFIG              = 0x100,
+};
+
+#define VIRTIO_STATUS_NEEDS_RESET 0x40
+#define VIRTQ_DESC_F_NEXT  1
+#define VIRTQ_DESC_F_WRITE 2
+
+typedef struct {
+  uint64_t addr;
+  uint32_t len;
+  uint16_t flags;
+  uint16_t next;
+} VirtqDesc;
+
+typedef struct {
+  uint16_t flags;
+  uint16_t idx;
+  uint16_t ring[];
+} VirtqAvail;
+
+typedef struct {
+  uint16_t flags;
+  uint16_t idx;
+  struct { uint32_t id, len; } ring[];
+} VirtqUsed;
+
+// The structures of virtqueues and the buffers are accessed through host
+// pointers into pmem after checking the bound.
+static void* guest_ptr(uint64_t addr, uint64_t len) {
+  if (addr < PMEM_LEFT || addr > PMEM_RIGHT || len > PMEM_RIGHT - addr + 1) return NULL;
+  return guest_to_host(addr);
+}
+
+static void virtio_error(VirtioDev *dev, const char *msg) {
+  Log("%s: %s", dev->name, msg);
+  dev->status |= VIRTIO_STATUS_NEEDS_RESET;
+}
+
+bool virtq_pop(VirtioDev *dev, int q, VirtqElem *e) {
+  VirtQueue *vq = &dev->vq[q];
+  VirtqAvail *avail = guest_ptr(vq->avail, sizeof(VirtqAvail) + vq->num * sizeof(uint16_t));
+  VirtqDesc *desc = guest_ptr(vq->desc, vq->num * sizeof(VirtqDesc));
+  if (avail == NULL || desc == NULL) { virtio_error(dev, "bad virtqueue address"); return false; }
+  if (vq->last_avail == avail->idx) return false;
+
+  e->head = avail->ring[vq->last_avail % vq->num];
+  e->nr_out = e->nr_in = 0;
+  e->out_len = e->in_len = 0;
+  uint16_t idx = e->head;
+  int n;
+  for (n = 0; ; n ++) {
+    if (idx >= vq->num || n >= vq->num) { virtio_error(dev, "bad descriptor chain"); return false; }
+    VirtqDesc *d = &desc[idx];
+    void *p = guest_ptr(d->addr, d->len);
+    if (p == NULL) { virtio_error(dev, "bad buffer address"); return false; }
+    bool is_in = (d->flags & VIRTQ_DESC_F_WRITE) != 0;
+    int *nr = (is_in ? &e->nr_in : &e->nr_out);
+    if (*nr == VIRTQ_MAX_SEG) { virtio_error(dev, "too many segments"); return false; }
+    (is_in ? e->in : e->out)[(*nr) ++] = (struct iovec) { .iov_base = p, .iov_len = d->len };
+    *(is_in ? &e->in_len : &e->out_len) += d->len;
+    if (!(d->flags & VIRTQ_DESC_F_NEXT)) break;
+    idx = d->next;
+  }
+  vq->last_avail ++;
+  return true;
+}
+
+void virtq_push(VirtioDev *dev, int q, VirtqElem *e, uint32_t len) {
+  VirtQueue *vq = &dev->vq[q];
+  VirtqUsed *used = guest_ptr(vq->used, sizeof(VirtqUsed) + vq->num * sizeof(used->ring[0]));
+  if (used == NULL) { virtio_error(dev, "bad virtqueue address"); return; }
+  uint16_t slot = used->idx % vq->num;
+  used->ring[slot].id = e->head;
+  used->ring[slot].len = len;
+  used->idx ++;
+
+#ifdef CONFIG_DIFFTEST
+  // the REF does not run the device, sync the memory written by it
+  int i;
+  for (i = 0; i < e->nr_in && len > 0; i ++) {
+    uint32_t n = (e->in[i].iov_len < len ? e->in[i].iov_len : len);
+    difftest_dma_write(host_to_guest(e->in[i].iov_base), n);
+    len -= n;
+  }
+  difftest_dma_write(host_to_guest((uint8_t *)&used->ring[slot]), sizeof(used->ring[0]));
+  difftest_dma_write(host_to_guest((uint8_t *)&used->idx), sizeof(used->idx));
+#endif
+}
+
+static void virtio_update_irq(VirtioDev *dev) {
+  dev_set_irq(dev->irq, dev->isr != 0);
+}
+
+void virtio_notify(VirtioDev *dev) {
+  dev->isr |= 1; // used buffer notification
+  virtio_update_irq(dev);
+}
+
+static void virtio_reset(VirtioDev *dev) {
+  dev->driver_features = 0;
+  dev->status = dev->isr = 0;
+  dev->features_sel = dev->driver_features_sel = dev->queue_sel = 0;
+  memset(dev->vq, 0, sizeof(dev->vq));
+  virtio_update_irq(dev);
+  if (dev->reset) dev->reset(dev);
+}
+
+// the queue selected, or NULL if it does not exist
+static VirtQueue* selected_vq(VirtioDev *dev) {
+  return (dev->queue_sel < dev->nr_queue ? &dev->vq[dev->queue_sel] : NULL);
+}
+
+static uint32_t virtio_mmio_read(VirtioDev *dev, uint32_t offset) {
+  uint64_t features = dev->features | (1ull << VIRTIO_F_VERSION_1);
+  VirtQueue *vq = selected_vq(dev);
+  switch (offset) {
+    case VIRTIO_MMIO_MAGIC_VALUE: return VIRTIO_MMIO_MAGIC;
+    case VIRTIO_MMIO_VERSION: return 2;
+    case VIRTIO_MMIO_DEVICE_ID: return dev->device_id;
+    case VIRTIO_MMIO_VENDOR_ID: return VIRTIO_MMIO_VENDOR;
+    case VIRTIO_MMIO_DEVICE_FEATURES:
+      return (dev->features_sel == 0 ? (uint32_t)features : dev->features_sel == 1 ? features >> 32 : 0);
+    case VIRTIO_MMIO_QUEUE_NUM_MAX: return (vq ? VIRTQ_MAX_SIZE : 0);
+    case VIRTIO_MMIO_QUEUE_READY: return (vq ? vq->ready : 0);
+    case VIRTIO_MMIO_INTERRUPT_STATUS: return dev->isr;
+    case VIRTIO_MMIO_STATUS: return dev->status;
+    case VIRTIO_MMIO_CONFIG_GENERATION: return 0;
+    default: return 0;
+  }
+}
+
+static void virtio_mmio_write(VirtioDev *dev, uint32_t offset, uint32_t data) {
+  VirtQueue *vq = selected_vq(dev);
+  bool is_queue_reg = (offset == VIRTIO_MMIO_QUEUE_NUM || offset == VIRTIO_MMIO_QUEUE_READY ||
+      (offset >= VIRTIO_MMIO_QUEUE_DESC_LOW && offset <= VIRTIO_MMIO_QUEUE_DEVICE_HIGH));
+  // writes to the registers of a queue not existing are ignored
+  if (is_queue_reg && vq == NULL) return;
+  switch (offset) {
+    case VIRTIO_MMIO_DEVICE_FEATURES_SEL: dev->features_sel = data; break;
+    case VIRTIO_MMIO_DRIVER_FEATURES_SEL: dev->driver_features_sel = data; break;
+    case VIRTIO_MMIO_DRIVER_FEATURES:
+      if (dev->driver_features_sel < 2) {
+        int shift = dev->driver_features_sel * 32;
+        dev->driver_features &= ~(0xffffffffull << shift);
+        dev->driver_features |= (uint64_t)data << shift;
+      }
+      break;
+    case VIRTIO_MMIO_QUEUE_SEL: dev->queue_sel = data; break;
+    case VIRTIO_MMIO_QUEUE_NUM:
+      if (data == 0 || data > VIRTQ_MAX_SIZE || (data & (data - 1))) virtio_error(dev, "bad queue size");
+      else vq->num = data;
+      break;
+    case VIRTIO_MMIO_QUEUE_READY:
+      vq->ready = (data & 1) && vq->num != 0;
+      break;
+    case VIRTIO_MMIO_QUEUE_NOTIFY:
+      if (data < dev->nr_queue && virtq_ready(dev, data)) dev->notify(dev, data);
+      break;
+    case VIRTIO_MMIO_INTERRUPT_ACK:
+      dev->isr &= ~data;
+      virtio_update_irq(dev);
+      break;
+    case VIRTIO_MMIO_STATUS:
+      if (data == 0) virtio_reset(dev);
+      else dev->status = data;
+      break;
+#define SET_HALF(field, hi) field = (hi ? (field & 0xffffffffull) | ((uint64_t)data << 32) : \
+                                          (field & ~0xffffffffull) | data)
+    case VIRTIO_MMIO_QUEUE_DESC_LOW:    SET_HALF(vq->desc, false); break;
+    case VIRTIO_MMIO_QUEUE_DESC_HIGH:   SET_HALF(vq->desc, true); break;
+    case VIRTIO_MMIO_QUEUE_DRIVER_LOW:  SET_HALF(vq->avail, false); break;
+    case VIRTIO_MMIO_QUEUE_DRIVER_HIGH: SET_HALF(vq->avail, true); break;
+    case VIRTIO_MMIO_QUEUE_DEVICE_LOW:  SET_HALF(vq->used, false); break;
+    case VIRTIO_MMIO_QUEUE_DEVICE_HIGH: SET_HALF(vq->used, true); break;
+    default: break;
+  }
+}
+
+static void virtio_mmio_io(VirtioDev *dev, uint32_t offset, int len, bool is_write) {
+  if (offset >= VIRTIO_MMIO_CONFIG) return; // the configuration space is kept in place
+  assert(len == 4 && offset % 4 == 0);
+  uint32_t *reg = (uint32_t *)(dev->base + offset);
+  if (is_write) virtio_mmio_write(dev, offset, *reg);
+  else *reg = virtio_mmio_read(dev, offset);
+}
+
+// The callback of a map does not take the device as an argument,
+// so define one for each device slot.
+#define VIRTIO_MAX_DEV 4
+static VirtioDev *devs[VIRTIO_MAX_DEV] = {};
+static int nr_dev = 0;
+
+#define VIRTIO_HANDLER(i) \
+  static void concat(virtio_mmio_handler, i)(uint32_t offset, int len, bool is_write) { \
+    virtio_mmio_io(devs[i], offset, len, is_write); \
+  }
+VIRTIO_HANDLER(0) VIRTIO_HANDLER(1) VIRTIO_HANDLER(2) VIRTIO_HANDLER(3)
+static const io_callback_t handlers[VIRTIO_MAX_DEV] = {
+  virtio_mmio_handler0, virtio_mmio_handler1, virtio_mmio_handler2, virtio_mmio_handler3,
+};
+
+void virtio_mmio_init(VirtioDev *dev, paddr_t addr) {
+  assert(nr_dev < VIRTIO_MAX_DEV);
+  assert(dev->nr_queue <= VIRTIO_MAX_QUEUE && dev->config_size <= VIRTIO_MMIO_SIZE - VIRTIO_MMIO_CONFIG);
+  dev->base = new_space(VIRTIO_MMIO_SIZE);
+  dev->config = dev->base + VIRTIO_MMIO_CONFIG;
+  devs[nr_dev] = dev;
+  add_mmio_map(dev->name, addr, dev->base, VIRTIO_MMIO_SIZE, handlers[nr_dev]);
+  nr_dev ++;
+  virtio_reset(dev);
+}
@@ -0,0 +1,150 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <device/virtio.h>
+#include <device/alarm.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// virtio network device whose backend is a Unix datagram socket. Each
+// datagram is an Ethernet frame. The socket is bound to a local path and
+// sends to a peer path, so two NEMU instances with the paths swapped, or
+// NEMU and a test program, can exchange frames without host networking.
+
+enum { RX_QUEUE, TX_QUEUE, NR_QUEUE };
+
+#define VIRTIO_NET_F_MAC 5
+// struct virtio_net_hdr with num_buffers, which always exists with VERSION_1
+#define NET_HDR_SIZE 12
+#define NET_HDR_NUM_BUFFERS 10
+
+static VirtioDev dev = {};
+static int sock_fd = -1;
+static int sock_event = -1;
+static struct sockaddr_un peer = { .sun_family = AF_UNIX };
+
+// skip the first `skip` bytes of `src`, return the number of iovecs left
+static int iov_skip(struct iovec *dst, const struct iovec *src, int n, size_t skip) {
+  int i, k = 0;
+  for (i = 0; i < n; i ++) {
+    if (skip >= src[i].iov_len) { skip -= src[i].iov_len; continue; }
+    dst[k].iov_base = (uint8_t *)src[i].iov_base + skip;
+    dst[k].iov_len = src[i].iov_len - skip;
+    skip = 0;
+    k ++;
+  }
+  return k;
+}
+
+static void net_tx() {
+  VirtqElem e;
+  struct iovec iov[VIRTQ_MAX_SEG];
+  bool pushed = false;
+  while (virtq_pop(&dev, TX_QUEUE, &e)) {
+    // the frame is sent from pmem directly, without the header
+    struct msghdr msg = { .msg_name = &peer, .msg_namelen = sizeof(peer), .msg_iov = iov };
+    msg.msg_iovlen = iov_skip(iov, e.out, e.nr_out, NET_HDR_SIZE);
+    if (e.out_len > NET_HDR_SIZE) {
+      // the frame is dropped if the peer is not ready
+      sendmsg(sock_fd, &msg, MSG_DONTWAIT);
+    }
+    virtq_push(&dev, TX_QUEUE, &e, 0);
+    pushed = true;
+  }
+  if (pushed) virtio_notify(&dev);
+}
+
+static void net_rx() {
+  if (!virtq_ready(&dev, RX_QUEUE)) return;
+  VirtqElem e;
+  struct iovec iov[VIRTQ_MAX_SEG];
+  bool pushed = false;
+  while (true) {
+    // check whether there is a frame before taking a buffer
+    ssize_t n = recv(sock_fd, NULL, 0, MSG_PEEK | MSG_TRUNC | MSG_DONTWAIT);
+    if (n < 0) {
+      // the socket is drained, wait for the next frame
+      rewatch_alarm_fd(sock_event);
+      break;
+    }
+    // if there is no buffer, wait for the driver to notify the receive queue
+    if (!virtq_pop(&dev, RX_QUEUE, &e)) break;
+    // the frame is received into pmem directly, after the header
+    struct msghdr msg = { .msg_iov = iov };
+    msg.msg_iovlen = iov_skip(iov, e.in, e.nr_in, NET_HDR_SIZE);
+    n = recvmsg(sock_fd, &msg, MSG_DONTWAIT);
+    if (n < 0 || (msg.msg_flags & MSG_TRUNC) || e.in_len < NET_HDR_SIZE) {
+      // the frame is dropped if the buffer is too small
+      virtq_push(&dev, RX_QUEUE, &e, 0);
+    } else {
+      uint8_t hdr[NET_HDR_SIZE] = {};
+      hdr[NET_HDR_NUM_BUFFERS] = 1;
+      int i;
+      size_t off = 0;
+      for (i = 0; i < e.nr_in && off < NET_HDR_SIZE; i ++) {
+        size_t len = (e.in[i].iov_len < NET_HDR_SIZE - off ? e.in[i].iov_len : NET_HDR_SIZE - off);
+        memcpy(e.in[i].iov_base, hdr + off, len);
+        off += len;
+      }
+      virtq_push(&dev, RX_QUEUE, &e, NET_HDR_SIZE + n);
+    }
+    pushed = true;
+  }
+  if (pushed) virtio_notify(&dev);
+}
+
+static void net_notify(VirtioDev *d, int q) {
+  if (q == TX_QUEUE) net_tx();
+  else net_rx();
+}
+
+static void init_mac() {
+  unsigned int mac[6];
+  int n = sscanf(CONFIG_VIRTIO_NET_MAC, "%x:%x:%x:%x:%x:%x",
+      &mac[0], &mac[1], &mac[2], &mac[3], &mac[4], &mac[5]);
+  Assert(n == 6, "Invalid MAC address %s", CONFIG_VIRTIO_NET_MAC);
+  int i;
+  for (i = 0; i < 6; i ++) dev.config[i] = mac[i];
+}
+
+void init_virtio_net() {
+  dev.name = "virtio-net";
+  dev.device_id = VIRTIO_ID_NET;
+  dev.features = 1ull << VIRTIO_NET_F_MAC;
+  dev.nr_queue = NR_QUEUE;
+  dev.irq = CONFIG_VIRTIO_NET_IRQ;
+  dev.config_size = 6;
+  dev.notify = net_notify;
+  virtio_mmio_init(&dev, CONFIG_VIRTIO_NET_MMIO);
+  init_mac();
+
+  const char *local = CONFIG_VIRTIO_NET_LOCAL, *remote = CONFIG_VIRTIO_NET_PEER;
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  Assert(strlen(local) < sizeof(addr.sun_path) && strlen(remote) < sizeof(peer.sun_path),
+      "Path of socket is too long");
+  strcpy(addr.sun_path, local);
+  strcpy(peer.sun_path, remote);
+  sock_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  Assert(sock_fd != -1, "Can not create socket");
+  unlink(local);
+  int ret = bind(sock_fd, (struct sockaddr *)&addr, sizeof(addr));
+  Assert(ret == 0, "Can not bind socket %s", local);
+  // enlarge the buffer to hold more frames
+  int size = 1 << 20;
+  setsockopt(sock_fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+  sock_event = add_alarm_fd(sock_fd, net_rx);
+  Log("virtio net: %s <-> %s", local, remote);
+}
@@ -0,0 +1,37 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <isa.h>
+#include <cpu/decode.h>
+#include <difftest-def.h>
+
+void isa_difftest_commit(Decode *s, DifftestCommit *c) {
+  uint32_t i = s->isa.inst;
+  int rd = BITS(i, 4, 0);
+  c->inst = i;
+  switch (BITS(i, 31, 26)) {
+    case 0x15: rd = 1; break; // bl
+    case 0x13: break;         // jirl
+    case 0x10 ... 0x12: case 0x14: case 0x16 ... 0x1b: return; // other branches
+    default:
+      if (BITS(i, 31, 22) >= 0x0a4 && BITS(i, 31, 22) <= 0x0a6) return; // store
+      if (BITS(i, 31, 16) == 0x002a || BITS(i, 31, 16) == 0x002b) return; // break, syscall
+  }
+  if (rd != 0) {
+    c->rd = rd;
+    c->wen = 1;
+    c->wdata = cpu.gpr[rd];
+  }
+}
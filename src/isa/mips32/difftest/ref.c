@@ -0,0 +1,43 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <isa.h>
+#include <cpu/decode.h>
+#include <difftest-def.h>
+
+void isa_difftest_commit(Decode *s, DifftestCommit *c) {
+  uint32_t i = s->isa.inst;
+  int rd = -1;
+  c->inst = i;
+  switch (BITS(i, 31, 26)) {
+    case 0x00: // SPECIAL
+      switch (BITS(i, 5, 0)) {
+        case 0x08: case 0x0c: case 0x0d: case 0x11: case 0x13: // jr, syscall, break, mthi, mtlo
+        case 0x18: case 0x19: case 0x1a: case 0x1b: break;     // mult, multu, div, divu
+        default: rd = BITS(i, 15, 11);
+      }
+      break;
+    case 0x01: if (BITS(i, 20, 17) == 0x8) rd = 31; break; // bltzal, bgezal
+    case 0x03: rd = 31; break; // jal
+    case 0x10: if (BITS(i, 25, 21) == 0) rd = BITS(i, 20, 16); break; // mfc0
+    case 0x1c: if (BITS(i, 5, 0) == 0x02) rd = BITS(i, 15, 11); break; // mul
+    case 0x08 ... 0x0f: case 0x20 ... 0x26: rd = BITS(i, 20, 16); break; // ALU with imm, load
+  }
+  if (rd > 0) {
+    c->rd = rd;
+    c->wen = 1;
+    c->wdata = cpu.gpr[rd];
+  }
+}
@@ -40,3 +40,12 @@ void init_isa() {
   /* Initialize this virtual computer system. */
   restart();
 }
+
+void isa_boot_kernel(vaddr_t entry, paddr_t dtb) {
+  cpu.pc = entry;
+  if (dtb != 0) {
+    // UHI boot protocol
+    cpu.gpr[4] = -2;  // a0 = -2
+    cpu.gpr[5] = dtb; // a1 = address of the device tree
+  }
+}
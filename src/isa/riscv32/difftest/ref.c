@@ -0,0 +1,33 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <isa.h>
+#include <cpu/decode.h>
+#include <difftest-def.h>
+#include "../local-include/reg.h"
+
+void isa_difftest_commit(Decode *s, DifftestCommit *c) {
+  uint32_t i = s->isa.inst;
+  int rd = BITS(i, 11, 7);
+  c->inst = i;
+  switch (BITS(i, 6, 0)) {
+    case 0x23: case 0x63: case 0x0f: return; // store, branch, fence
+  }
+  if (rd != 0) {
+    c->rd = rd;
+    c->wen = 1;
+    c->wdata = gpr(rd);
+  }
+}
@@ -28,6 +28,12 @@ typedef struct {
   uint32_t inst;
 } MUXDEF(CONFIG_RV64, riscv64_ISADecodeInfo, riscv32_ISADecodeInfo);
 
+// interrupt numbers, also the bits in mip
+enum {
+  IRQ_S_SOFT = 1, IRQ_M_SOFT = 3, IRQ_S_TIMER = 5,
+  IRQ_M_TIMER = 7, IRQ_S_EXT = 9, IRQ_M_EXT = 11,
+};
+
 #define isa_mmu_check(vaddr, len, type) (MMU_DIRECT)
 
 #endif
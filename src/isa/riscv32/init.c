@@ -41,3 +41,9 @@ void init_isa() {
   /* Initialize this virtual computer system. */
   restart();
 }
+
+void isa_boot_kernel(vaddr_t entry, paddr_t dtb) {
+  cpu.pc = entry;
+  cpu.gpr[10] = 0;   // a0 = hartid
+  cpu.gpr[11] = dtb; // a1 = address of the device tree
+}
@@ -23,6 +23,8 @@ word_t isa_raise_intr(word_t NO, vaddr_t epc) {
   return 0;
 }
 
+// The interrupts raised by CLINT and PLIC are in `dev_intr_pending`
+// of <device/intr.h>, bit i for the interrupt with mcause i.
 word_t isa_query_intr() {
   return INTR_EMPTY;
 }
@@ -0,0 +1,44 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include "../local-include/csr.h"
+#include <device/perf.h>
+
+#ifdef CONFIG_HAS_PERFCTR
+// Since NEMU retires one instruction per cycle, cycle is the same as instret.
+// time is mtime of CLINT if it is enabled, see perf_read().
+// hpmcounter3 and the followings are the other NEMU event counters.
+bool perf_csr_read(uint32_t addr, word_t *val) {
+  bool high = false;
+#ifndef CONFIG_RV64
+  if ((addr & 0xf80) == 0xc80 || (addr & 0xf80) == 0xb80) {
+    high = true;
+    addr &= ~0x80;
+  }
+#endif
+  int idx;
+  switch (addr) {
+    case CSR_CYCLE: case CSR_INSTRET: case CSR_MCYCLE: case CSR_MINSTRET:
+      idx = PERF_INSTRET; break;
+    case CSR_TIME: idx = PERF_TIME_US; break;
+    case CSR_HPMCOUNTER3 ... CSR_HPMCOUNTER31: idx = addr - CSR_HPMCOUNTER3 + PERF_MMIO_READ; break;
+    case CSR_MHPMCOUNTER3 ... CSR_MHPMCOUNTER31: idx = addr - CSR_MHPMCOUNTER3 + PERF_MMIO_READ; break;
+    default: return false;
+  }
+  uint64_t cnt = (idx < NR_PERF ? perf_read(idx) : 0);
+  *val = (high ? cnt >> 32 : cnt);
+  return true;
+}
+#endif
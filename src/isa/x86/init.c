@@ -60,3 +60,8 @@ void init_isa() {
   init_i8237a();
 #endif
 }
+
+void isa_boot_kernel(vaddr_t entry, paddr_t dtb) {
+  Assert(dtb == 0, "passing a device tree to the kernel is not supported by " str(__GUEST_ISA__));
+  cpu.pc = entry;
+}
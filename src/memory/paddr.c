@@ -13,13 +13,23 @@
 * See the Mulan PSL v2 for more details.
 ***************************************************************************************/
 
+#define _GNU_SOURCE
 #include <memory/host.h>
 #include <memory/paddr.h>
 #include <device/mmio.h>
 #include <isa.h>
+#include <cpu/difftest.h>
+#ifndef CONFIG_TARGET_AM
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
 #if   defined(CONFIG_PMEM_MALLOC)
 static uint8_t *pmem = NULL;
+#elif defined(CONFIG_PMEM_MEMFD)
+static uint8_t *pmem = NULL;
+static int pmem_fd = -1;
+int pmem_memfd() { return pmem_fd; }
 #else // CONFIG_PMEM_GARRAY
 static uint8_t pmem[CONFIG_MSIZE] PG_ALIGN = {};
 #endif
@@ -33,6 +43,9 @@ static word_t pmem_read(paddr_t addr, int len) {
 }
 
 static void pmem_write(paddr_t addr, int len, word_t data) {
+  IFDEF(CONFIG_DIFFTEST_BATCH, difftest_log_write(addr, len));
+  IFDEF(CONFIG_DIFFTEST_MEMCHECK, difftest_mark_dirty(addr, len));
+  difftest_unshare(addr, len);
   host_write(guest_to_host(addr), len, data);
 }
 
@@ -45,11 +58,37 @@ void init_mem() {
 #if   defined(CONFIG_PMEM_MALLOC)
   pmem = malloc(CONFIG_MSIZE);
   assert(pmem);
+#elif defined(CONFIG_PMEM_MEMFD)
+  pmem_fd = memfd_create("nemu-pmem", 0);
+  Assert(pmem_fd >= 0, "memfd_create() failed");
+  int ret = ftruncate(pmem_fd, CONFIG_MSIZE);
+  Assert(ret == 0, "can not set the size of memfd");
+  pmem = mmap(NULL, CONFIG_MSIZE, PROT_READ | PROT_WRITE, MAP_SHARED, pmem_fd, 0);
+  Assert(pmem != MAP_FAILED, "can not map memfd");
 #endif
   IFDEF(CONFIG_MEM_RANDOM, memset(pmem, rand(), CONFIG_MSIZE));
   Log("physical memory area [" FMT_PADDR ", " FMT_PADDR "]", PMEM_LEFT, PMEM_RIGHT);
 }
 
+#ifndef CONFIG_TARGET_AM
+// Pages are shared with the owner of `fd` until they are written here.
+// This is used by REF, so that the image of DUT does not need to be copied.
+// The memory allocated by init_mem() is released.
+void pmem_share(int fd) {
+  void *p = mmap(MUXDEF(CONFIG_PMEM_GARRAY, pmem, NULL), CONFIG_MSIZE, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MUXDEF(CONFIG_PMEM_GARRAY, MAP_FIXED, 0), fd, 0);
+  Assert(p != MAP_FAILED, "can not map the memory shared by fd = %d", fd);
+#if   defined(CONFIG_PMEM_MALLOC)
+  free(pmem);
+#elif defined(CONFIG_PMEM_MEMFD)
+  munmap(pmem, CONFIG_MSIZE);
+  close(pmem_fd);
+  pmem_fd = -1;
+#endif
+  IFNDEF(CONFIG_PMEM_GARRAY, pmem = p);
+}
+#endif
+
 word_t paddr_read(paddr_t addr, int len) {
   if (likely(in_pmem(addr))) return pmem_read(addr, len);
   IFDEF(CONFIG_DEVICE, return mmio_read(addr, len));
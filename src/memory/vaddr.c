@@ -15,15 +15,18 @@
 
 #include <isa.h>
 #include <memory/paddr.h>
+#include <cpu/difftest.h>
 
 word_t vaddr_ifetch(vaddr_t addr, int len) {
   return paddr_read(addr, len);
 }
 
 word_t vaddr_read(vaddr_t addr, int len) {
+  IFDEF(CONFIG_TARGET_SHARE, difftest_commit_mem(addr, len, 0, false));
   return paddr_read(addr, len);
 }
 
 void vaddr_write(vaddr_t addr, int len, word_t data) {
+  IFDEF(CONFIG_TARGET_SHARE, difftest_commit_mem(addr, len, data, true));
   paddr_write(addr, len, data);
 }
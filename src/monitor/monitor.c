@@ -40,10 +40,14 @@ static void welcome() {
 #include <getopt.h>
 
 void sdb_set_batch_mode();
+void sdcard_set_overlay(const char *path);
 
 static char *log_file = NULL;
 static char *diff_so_file = NULL;
 static char *img_file = NULL;
+static char *kernel_file = NULL;
+static char *initrd_file = NULL;
+static char *dtb_file = NULL;
 static int difftest_port = 1234;
 
 static long load_img() {
@@ -68,22 +72,110 @@ static long load_img() {
   return size;
 }
 
+// load `file` to `addr`, and return its size
+static long load_file(const char *file, paddr_t addr) {
+  FILE *fp = fopen(file, "rb");
+  Assert(fp, "Can not open '%s'", file);
+
+  fseek(fp, 0, SEEK_END);
+  long size = ftell(fp);
+  Assert(in_pmem(addr) && size <= PMEM_RIGHT - addr + 1,
+      "'%s' of size %ld can not be loaded at " FMT_PADDR, file, size, addr);
+
+  fseek(fp, 0, SEEK_SET);
+  int ret = fread(guest_to_host(addr), size, 1, fp);
+  assert(ret == 1 || size == 0);
+
+  fclose(fp);
+  Log("Load '%s' at " FMT_PADDR ", size = %ld", file, addr, size);
+  return size;
+}
+
+// regions loaded by load_kernel(), which must not overlap each other
+static struct {
+  const char *name;
+  paddr_t start, end;
+} region[4];
+static int nr_region = 0;
+
+static void add_region(const char *name, paddr_t start, paddr_t end) {
+  for (int i = 0; i < nr_region; i ++) {
+    Assert(end <= region[i].start || start >= region[i].end,
+        "%s [" FMT_PADDR ", " FMT_PADDR ") overlaps with %s [" FMT_PADDR ", " FMT_PADDR ")",
+        name, start, end, region[i].name, region[i].start, region[i].end);
+  }
+  region[nr_region].name = name;
+  region[nr_region].start = start;
+  region[nr_region].end = end;
+  nr_region ++;
+}
+
+// Load the kernel, initrd and device tree, and start at the kernel directly
+// to skip the firmware. Return the size of memory from the reset vector
+// to the end of the loaded files, which should be copied to the REF.
+static long load_kernel(long img_size) {
+  paddr_t end = RESET_VECTOR + img_size;
+  if (img_file) add_region("image", RESET_VECTOR, end);
+#define LOAD(name, file, offset) do { \
+    paddr_t addr = CONFIG_MBASE + offset; \
+    paddr_t e = addr + load_file(file, addr); \
+    add_region(name, addr, e); \
+    if (e > end) end = e; \
+  } while (0)
+
+  paddr_t entry = CONFIG_MBASE + CONFIG_KERNEL_LOAD_OFFSET;
+  LOAD("kernel", kernel_file, CONFIG_KERNEL_LOAD_OFFSET);
+  paddr_t initrd_start = 0, initrd_end = 0;
+  if (initrd_file) {
+    initrd_start = CONFIG_MBASE + CONFIG_INITRD_LOAD_OFFSET;
+    initrd_end = initrd_start + load_file(initrd_file, initrd_start);
+    add_region("initrd", initrd_start, initrd_end);
+    if (initrd_end > end) end = initrd_end;
+  }
+  paddr_t dtb = 0;
+  if (dtb_file) {
+    dtb = CONFIG_MBASE + CONFIG_DTB_LOAD_OFFSET;
+    LOAD("device tree", dtb_file, CONFIG_DTB_LOAD_OFFSET);
+  }
+#ifdef CONFIG_GEN_DTB
+  else {
+    long gen_dtb(paddr_t addr, paddr_t initrd_start, paddr_t initrd_end);
+    dtb = CONFIG_MBASE + CONFIG_DTB_LOAD_OFFSET;
+    paddr_t e = dtb + gen_dtb(dtb, initrd_start, initrd_end);
+    add_region("device tree", dtb, e);
+    if (e > end) end = e;
+    Log("The device tree is generated at " FMT_PADDR, dtb);
+  }
+#endif
+  isa_boot_kernel(entry, dtb);
+  Log("Boot the kernel at " FMT_PADDR " directly", entry);
+  return end - RESET_VECTOR;
+}
+
 static int parse_args(int argc, char *argv[]) {
   const struct option table[] = {
     {"batch"    , no_argument      , NULL, 'b'},
     {"log"      , required_argument, NULL, 'l'},
     {"diff"     , required_argument, NULL, 'd'},
     {"port"     , required_argument, NULL, 'p'},
+    {"kernel"   , required_argument, NULL, 'k'},
+    {"initrd"   , required_argument, NULL, 'i'},
+    {"dtb"      , required_argument, NULL, 't'},
+    {"sd-overlay", required_argument, NULL, 's'},
     {"help"     , no_argument      , NULL, 'h'},
     {0          , 0                , NULL,  0 },
   };
   int o;
-  while ( (o = getopt_long(argc, argv, "-bhl:d:p:", table, NULL)) != -1) {
+  while ( (o = getopt_long(argc, argv, "-bhl:d:p:k:i:t:s:", table, NULL)) != -1) {
     switch (o) {
       case 'b': sdb_set_batch_mode(); break;
       case 'p': sscanf(optarg, "%d", &difftest_port); break;
       case 'l': log_file = optarg; break;
       case 'd': diff_so_file = optarg; break;
+      case 'k': kernel_file = optarg; break;
+      case 'i': initrd_file = optarg; break;
+      case 't': dtb_file = optarg; break;
+      case 's': IFDEF(CONFIG_HAS_SDCARD, sdcard_set_overlay(optarg)); break;
       case 1: img_file = optarg; return 0;
       default:
         printf("Usage: %s [OPTION...] IMAGE [args]\n\n", argv[0]);
@@ -91,6 +183,10 @@ static int parse_args(int argc, char *argv[]) {
         printf("\t-l,--log=FILE           output log to FILE\n");
         printf("\t-d,--diff=REF_SO        run DiffTest with reference REF_SO\n");
         printf("\t-p,--port=PORT          run DiffTest with port PORT\n");
+        printf("\t-k,--kernel=FILE        boot the kernel FILE directly\n");
+        printf("\t-i,--initrd=FILE        load initrd FILE for the kernel\n");
+        printf("\t-t,--dtb=FILE           load device tree blob FILE for the kernel\n");
+        printf("\t-s,--sd-overlay=FILE    use FILE as the copy-on-write overlay of sdcard image\n");
         printf("\n");
         exit(0);
     }
@@ -121,6 +217,7 @@ void init_monitor(int argc, char *argv[]) {
 
   /* Load the image to memory. This will overwrite the built-in image. */
   long img_size = load_img();
+  if (kernel_file) img_size = load_kernel(img_size);
 
   /* Initialize differential testing. */
   init_difftest(diff_so_file, img_size, difftest_port);
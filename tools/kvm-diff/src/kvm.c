@@ -13,6 +13,7 @@
 * See the Mulan PSL v2 for more details.
 ***************************************************************************************/
 
+#define _GNU_SOURCE
 // from NEMU
 #include <memory/paddr.h>
 #include <isa-def.h>
@@ -22,7 +23,11 @@
 #include <errno.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <signal.h>
+#include <time.h>
 #include <linux/kvm.h>
+#include <linux/perf_event.h>
 
 /* CR0 bits */
 #define CR0_PE 1u
@@ -56,6 +61,36 @@ enum {
   STATE_IRET_INST,// if hit the watchpoint, then delete the watchpoint
 };
 
+#ifdef CONFIG_DIFFTEST_KVM_NATIVE
+// Run the guest natively when a batch of at least BATCH_MIN instructions is
+// requested. A counter of guest instructions interrupts KVM_RUN by a signal
+// when it overflows. The counter is set to stop BATCH_SKID instructions early
+// since the signal may arrive a few instructions late, and the rest are
+// single-stepped.
+//
+// The instructions patched by patching() and patching_after(), int/iret,
+// and port I/O must not run natively. Before a batch, the code reachable
+// from pc is decoded ahead, and hardware breakpoints are set at these
+// instructions, and at the points where the decoding can not go further,
+// such as ret and indirect jumps. The batch stops there, and the
+// instruction is single-stepped. If more than NR_HW_BP breakpoints are
+// needed, single-step for PLAN_BACKOFF instructions before trying again.
+// Faults in a batch are not expected, as their handlers are not decoded.
+#define BATCH_MIN  1024
+#define BATCH_SKID 256
+#define NR_HW_BP   4
+#define PLAN_MAX_INST 512
+#define PLAN_BACKOFF  64
+
+static int perf_fd = -1;
+static pid_t perf_tid = 0; // the counter only counts the thread opening it
+static bool perf_failed = false;
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+#endif
+
 static struct vm vm;
 static struct vcpu vcpu;
 static FILE *log_fp = NULL; // only to pass linking
@@ -73,6 +108,22 @@ static void kvm_set_step_mode(bool watch, uint32_t watch_addr) {
   }
 }
 
+#ifdef CONFIG_DIFFTEST_KVM_NATIVE
+// run without single-step, and stop at the instructions at `bp`
+static void kvm_set_native_mode(const uint32_t *bp, int nr_bp) {
+  struct kvm_guest_debug debug = { .control = KVM_GUESTDBG_ENABLE | KVM_GUESTDBG_USE_HW_BP };
+  int i;
+  for (i = 0; i < nr_bp; i ++) {
+    debug.arch.debugreg[i] = bp[i];
+    debug.arch.debugreg[7] |= 1u << (i * 2); // local enable, break on execution
+  }
+  if (ioctl(vcpu.fd, KVM_SET_GUEST_DEBUG, &debug) < 0) {
+    perror("KVM_SET_GUEST_DEBUG");
+    assert(0);
+  }
+}
+#endif
+
 static void kvm_setregs(const struct kvm_regs *r) {
   if (ioctl(vcpu.fd, KVM_SET_REGS, r) < 0) {
     perror("KVM_SET_REGS");
@@ -95,9 +146,10 @@ static void kvm_setsregs(const struct kvm_sregs *r) {
   }
 }
 
-static void* create_mem(int slot, uintptr_t base, size_t mem_size) {
+static void* create_mem(int slot, uintptr_t base, size_t mem_size, int fd) {
+  // the memory of DUT given by `fd` is copied on write
   void *mem = mmap(NULL, mem_size, PROT_READ | PROT_WRITE,
-      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+      MAP_PRIVATE | MAP_NORESERVE | (fd < 0 ? MAP_ANONYMOUS : 0), fd, 0);
   if (mem == MAP_FAILED) {
     perror("mmap mem");
     assert(0);
@@ -118,7 +170,7 @@ static void* create_mem(int slot, uintptr_t base, size_t mem_size) {
   return mem;
 }
 
-static void vm_init(size_t mem_size) {
+static void vm_init(size_t mem_size, int mem_fd) {
   int api_ver;
 
   vm.sys_fd = open("/dev/kvm", O_RDWR);
@@ -150,8 +202,8 @@ static void vm_init(size_t mem_size) {
     assert(0);
   }
 
-  vm.mem = create_mem(0, 0, mem_size);
-  vm.mmio = create_mem(1, 0xa1000000, 0x1000);
+  vm.mem = create_mem(0, 0, mem_size, mem_fd);
+  vm.mmio = create_mem(1, 0xa1000000, 0x1000, -1);
 }
 
 static void vcpu_init() {
@@ -286,46 +338,391 @@ static void patching_after(uint64_t last_pc) {
   }
 }
 
-static void kvm_exec(uint64_t n) {
-  for (; n > 0; n --) {
-    if (patching()) continue;
-
-    uint64_t pc = vcpu.kvm_run->s.regs.regs.rip;
-    if (ioctl(vcpu.fd, KVM_RUN, 0) < 0) {
-      if (errno == EINTR) {
-        n ++;
-        continue;
-      }
+#ifdef CONFIG_DIFFTEST_KVM_NATIVE
+// ---------- decoding ahead for native batches ----------
+
+enum { INST_NORMAL, INST_JMP, INST_JCC, INST_CALL, INST_STOP };
+
+static uint32_t code_page = -1;
+static uint8_t *code_host = NULL;
+
+// return the byte of code at `va`, or -1 if it is not in memory
+static int code_byte(uint32_t va) {
+  if ((va & ~0xfffu) != code_page) {
+    uint64_t pa = va2pa(va & ~0xfffu);
+    code_page = va & ~0xfffu;
+    code_host = (pa < CONFIG_MSIZE ? vm.mem + pa : NULL);
+  }
+  return code_host ? code_host[va & 0xfff] : -1;
+}
+
+static int code_rel(uint32_t va, int len) {
+  int b0 = code_byte(va), b1 = code_byte(va + 1), b2 = code_byte(va + 2), b3 = code_byte(va + 3);
+  if (len == 1) return (int8_t)b0;
+  if (len == 2) return (int16_t)(b0 | (b1 << 8));
+  return (int32_t)(b0 | (b1 << 8) | (b2 << 16) | ((uint32_t)b3 << 24));
+}
+
+// length of ModRM, SIB and displacement at `va`, the reg field is returned in `reg`
+static int modrm_len(uint32_t va, int *reg) {
+  int m = code_byte(va);
+  if (m < 0) return -1;
+  int mod = m >> 6, rm = m & 7, len = 1;
+  *reg = (m >> 3) & 7;
+  if (mod == 3) return len;
+  if (rm == 4) {
+    int sib = code_byte(va + 1);
+    if (sib < 0) return -1;
+    len ++;
+    if (mod == 0 && (sib & 7) == 5) len += 4;
+  }
+  if (mod == 0 && rm == 5) len += 4;
+  else if (mod == 1) len += 1;
+  else if (mod == 2) len += 4;
+  return len;
+}
+
+// Decode the instruction at `va` in 32-bit mode. Return its length, and
+// the kind of it in `kind`, with the target of a direct branch in `target`.
+// The instructions which should not run natively are INST_STOP, as well as
+// the ones not known here.
+static int decode(uint32_t va, int *kind, uint32_t *target) {
+  uint32_t p = va;
+  int opsize = 4, op, reg, len;
+  *kind = INST_NORMAL;
+  // prefixes
+  while (true) {
+    op = code_byte(p);
+    if (op == 0x66) opsize = 2;
+    else if (op == 0x67) goto stop; // 16-bit addressing
+    else if (!(op == 0xf0 || op == 0xf2 || op == 0xf3 || op == 0x26 || op == 0x2e ||
+          op == 0x36 || op == 0x3e || op == 0x64 || op == 0x65)) break;
+    p ++;
+  }
+  if (op < 0) goto stop;
+  p ++;
+
+  if (op == 0x0f) {
+    op = code_byte(p ++);
+    if (op >= 0x80 && op <= 0x8f) { // jcc rel
+      *kind = INST_JCC;
+      *target = p + opsize + code_rel(p, opsize);
+      return p + opsize - va;
+    }
+    if ((op >= 0x40 && op <= 0x4f) || (op >= 0x90 && op <= 0x9f) || op == 0xa3 || op == 0xa5 ||
+        op == 0xab || op == 0xad || op == 0xaf || (op >= 0xb0 && op <= 0xb7) ||
+        (op >= 0xbb && op <= 0xbf) || op == 0xc0 || op == 0xc1 || op == 0x1f) {
+      len = modrm_len(p, &reg);
+      return len < 0 ? len : p + len - va;
+    }
+    if (op == 0xa4 || op == 0xac || op == 0xba) {
+      len = modrm_len(p, &reg);
+      return len < 0 ? len : p + len + 1 - va;
+    }
+    if (op == 0xa1 || op == 0xa9 || (op >= 0xc8 && op <= 0xcf)) return p - va; // pop fs/gs, bswap
+    // push fs/gs, control registers, msr and the others
+    goto stop;
+  }
+
+  if (op < 0x40 && (op & 7) < 6) { // alu
+    switch (op & 7) {
+      case 4: return p + 1 - va;
+      case 5: return p + opsize - va;
+      default: len = modrm_len(p, &reg); return len < 0 ? len : p + len - va;
+    }
+  }
+  switch (op) {
+    case 0x07: case 0x17: case 0x1f: case 0x27: case 0x2f: case 0x37: case 0x3f:
+    case 0x40 ... 0x5f: case 0x60: case 0x61: case 0x90 ... 0x99: case 0x9b:
+    case 0x9e: case 0x9f: case 0xa4 ... 0xa7: case 0xaa ... 0xaf: case 0xc9:
+    case 0xd6: case 0xd7: case 0xf5: case 0xf8 ... 0xfd:
+      return p - va;
+    case 0x6a: case 0xa8: case 0xb0 ... 0xb7: case 0xd4: case 0xd5:
+      return p + 1 - va;
+    case 0x68: case 0xa9: case 0xb8 ... 0xbf:
+      return p + opsize - va;
+    case 0xa0 ... 0xa3: return p + 4 - va; // moffs
+    case 0xc8: return p + 3 - va; // enter
+    case 0x62: case 0x63: case 0x84 ... 0x8b: case 0x8c: case 0x8d: case 0x8e: case 0x8f:
+    case 0xc4: case 0xc5: case 0xd0 ... 0xd3: case 0xd8 ... 0xdf: case 0xfe:
+      len = modrm_len(p, &reg);
+      return len < 0 ? len : p + len - va;
+    case 0x6b: case 0x80: case 0x82: case 0x83: case 0xc0: case 0xc1: case 0xc6:
+      len = modrm_len(p, &reg);
+      return len < 0 ? len : p + len + 1 - va;
+    case 0x69: case 0x81: case 0xc7:
+      len = modrm_len(p, &reg);
+      return len < 0 ? len : p + len + opsize - va;
+    case 0xf6: case 0xf7:
+      len = modrm_len(p, &reg);
+      if (len < 0) return len;
+      return p + len + (reg <= 1 ? (op == 0xf6 ? 1 : opsize) : 0) - va; // test has an immediate
+    case 0xff:
+      len = modrm_len(p, &reg);
+      if (len < 0 || (reg >= 2 && reg <= 5)) goto stop; // indirect call/jmp
+      return p + len - va;
+    case 0x70 ... 0x7f: case 0xe0 ... 0xe3:
+      *kind = INST_JCC;
+      *target = p + 1 + code_rel(p, 1);
+      return p + 1 - va;
+    case 0xeb:
+      *kind = INST_JMP;
+      *target = p + 1 + code_rel(p, 1);
+      return p + 1 - va;
+    case 0xe9: case 0xe8:
+      *kind = (op == 0xe8 ? INST_CALL : INST_JMP);
+      *target = p + opsize + code_rel(p, opsize);
+      return p + opsize - va;
+    default:
+      // push sreg, pushf/popf, int/iret, ret, port I/O, hlt and far branches
+      break;
+  }
+stop:
+  *kind = INST_STOP;
+  return 0;
+}
+
+// Find the breakpoints to stop the batch starting from `pc`. Return the
+// number of breakpoints, or -1 if the batch can not start at `pc`.
+static int plan_batch(uint32_t pc, uint32_t *bp) {
+  static uint32_t visited[PLAN_MAX_INST * 2]; // open addressing, 0 is empty
+  static uint32_t worklist[PLAN_MAX_INST * 2];
+  int nr_bp = 0, nr_work = 0, nr_inst = 0, i;
+  memset(visited, 0, sizeof(visited));
+  code_page = -1;
+
+#define ADD_BP(addr) do { \
+    for (i = 0; i < nr_bp && bp[i] != (addr); i ++); \
+    if (i == nr_bp) { if (nr_bp == NR_HW_BP) return -1; bp[nr_bp ++] = (addr); } \
+  } while (0)
+
+  worklist[nr_work ++] = pc;
+  while (nr_work > 0) {
+    uint32_t va = worklist[-- nr_work];
+    uint32_t h = (va * 0x9e3779b1u) % ARRLEN(visited);
+    while (visited[h] != 0 && visited[h] != va + 1) h = (h + 1) % ARRLEN(visited);
+    if (visited[h] != 0) continue;
+    if (nr_inst == PLAN_MAX_INST) {
+      // not decoded, stop there
+      if (va == pc) return -1;
+      ADD_BP(va);
+      continue;
+    }
+    visited[h] = va + 1;
+    nr_inst ++;
+
+    int kind;
+    uint32_t target = 0;
+    int len = decode(va, &kind, &target);
+    if (kind == INST_STOP || len <= 0) {
+      if (va == pc) return -1;
+      ADD_BP(va);
+      continue;
+    }
+    // the worklist can not overflow since each instruction pushes at most 2
+    if (kind != INST_JMP && kind != INST_CALL) worklist[nr_work ++] = va + len;
+    // the instructions after a call are reached by ret, which is a breakpoint
+    if (kind != INST_NORMAL) worklist[nr_work ++] = target;
+  }
+#undef ADD_BP
+  return nr_bp;
+}
+
+static void perf_signal_handler(int sig) {
+  // nothing to do, just to interrupt KVM_RUN
+}
+
+static bool perf_init() {
+  if (perf_failed) return false;
+  pid_t tid = gettid();
+  if (perf_fd >= 0 && perf_tid == tid) return true;
+  if (perf_fd >= 0) close(perf_fd);
+
+  struct perf_event_attr attr = {
+    .type = PERF_TYPE_HARDWARE,
+    .size = sizeof(attr),
+    .config = PERF_COUNT_HW_INSTRUCTIONS,
+    .sample_period = 1ull << 40,
+    .disabled = 1,
+    .pinned = 1,
+    .exclude_host = 1, // only count the instructions in the guest
+    .wakeup_events = 1,
+  };
+  perf_fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+  if (perf_fd < 0) {
+    perror("perf_event_open");
+    goto fail;
+  }
+
+  struct sigaction sa = { .sa_handler = perf_signal_handler }; // without SA_RESTART
+  sigaction(SIGIO, &sa, NULL);
+  struct f_owner_ex owner = { .type = F_OWNER_TID, .pid = tid };
+  if (fcntl(perf_fd, F_SETFL, O_ASYNC) < 0 || fcntl(perf_fd, F_SETSIG, SIGIO) < 0 ||
+      fcntl(perf_fd, F_SETOWN_EX, &owner) < 0) {
+    perror("fcntl perf_fd");
+    close(perf_fd);
+    goto fail;
+  }
+  perf_tid = tid;
+  return true;
+
+fail:
+  printf("Can not count guest instructions, fall back to single-step\n");
+  perf_fd = -1;
+  perf_failed = true;
+  return false;
+}
+
+// Run natively until the counter reaches `period`, a breakpoint in `bp` is
+// hit, or the guest halts, and return the number of instructions executed.
+static uint64_t kvm_run_counted(uint64_t period, const uint32_t *bp, int nr_bp, bool *halt) {
+  struct kvm_regs *r = &vcpu.kvm_run->s.regs.regs;
+  r->rflags &= ~RFLAGS_TF;
+  vcpu.kvm_run->kvm_dirty_regs = KVM_SYNC_X86_REGS;
+  kvm_set_native_mode(bp, nr_bp);
+
+  ioctl(perf_fd, PERF_EVENT_IOC_RESET, 0);
+  ioctl(perf_fd, PERF_EVENT_IOC_PERIOD, &period);
+  ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+  int ret = ioctl(vcpu.fd, KVM_RUN, 0);
+  int err = errno;
+  ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+  uint64_t count = 0;
+  if (read(perf_fd, &count, sizeof(count)) != sizeof(count)) {
+    perror("read perf_fd");
+    assert(0);
+  }
+
+  r->rflags |= RFLAGS_TF;
+  vcpu.kvm_run->kvm_dirty_regs = KVM_SYNC_X86_REGS;
+  kvm_set_step_mode(false, 0);
+
+  if (ret < 0 && err != EINTR) {
+    errno = err;
+    perror("KVM_RUN");
+    assert(0);
+  }
+  *halt = false;
+  if (ret == 0) {
+    switch (vcpu.kvm_run->exit_reason) {
+      case KVM_EXIT_HLT: *halt = true; break;
+      case KVM_EXIT_DEBUG: break; // a breakpoint is hit
+      case KVM_EXIT_MMIO:
+        // MMIO and port I/O are skipped by DUT, so REF has diverged. Finish
+        // the access with zero by single-step, and let DUT find the divergence.
+        memset(vcpu.kvm_run->mmio.data, 0, sizeof(vcpu.kvm_run->mmio.data));
+        break;
+      case KVM_EXIT_IO:
+        memset((uint8_t *)vcpu.kvm_run + vcpu.kvm_run->io.data_offset, 0,
+            vcpu.kvm_run->io.size * vcpu.kvm_run->io.count);
+        break;
+      default:
+        fprintf(stderr, "Got exit_reason %d at pc = 0x%llx when running natively\n",
+            vcpu.kvm_run->exit_reason, r->rip);
+        assert(0);
+    }
+  }
+  return count;
+}
+
+// Check whether the counter works in the guest with the `jmp here` loop
+// left by run_protected_mode(). Otherwise the guest would never stop.
+static void perf_probe() {
+  if (!perf_init()) return;
+  timer_t timer;
+  struct sigevent sev = { .sigev_notify = SIGEV_THREAD_ID, .sigev_signo = SIGIO };
+  sev.sigev_notify_thread_id = perf_tid;
+  struct itimerspec its = { .it_value = { .tv_nsec = 100000000 } };
+  if (timer_create(CLOCK_MONOTONIC, &sev, &timer) < 0) {
+    perror("timer_create");
+    assert(0);
+  }
+  timer_settime(timer, 0, &its, NULL);
+  bool halt;
+  uint64_t count = kvm_run_counted(BATCH_MIN, NULL, 0, &halt);
+  timer_delete(timer);
+  if (count < BATCH_MIN || halt) {
+    printf("Guest instructions are not counted, fall back to single-step\n");
+    close(perf_fd);
+    perf_fd = -1;
+    perf_failed = true;
+  }
+}
+
+// Run at most `n` instructions natively, and return the number of them.
+static uint64_t kvm_run_batch(uint64_t n, bool *halt) {
+  static int backoff = 0;
+  uint32_t bp[NR_HW_BP];
+  *halt = false;
+  if (backoff > 0) {
+    backoff --;
+    return 0;
+  }
+  if (!perf_init()) return 0;
+  int nr_bp = plan_batch(vcpu.kvm_run->s.regs.regs.rip, bp);
+  if (nr_bp < 0) {
+    backoff = PLAN_BACKOFF;
+    return 0;
+  }
+  return kvm_run_counted(n, bp, nr_bp, halt);
+}
+#endif
+
+// execute one instruction by single-step, return false if the guest halts
+static bool kvm_step() {
+  if (patching()) return true;
+
+  uint64_t pc = vcpu.kvm_run->s.regs.regs.rip;
+  while (ioctl(vcpu.fd, KVM_RUN, 0) < 0) {
+    if (errno != EINTR) {
       perror("KVM_RUN");
       assert(0);
     }
+  }
 
-    if (vcpu.kvm_run->exit_reason != KVM_EXIT_DEBUG) {
-      if (vcpu.kvm_run->exit_reason == KVM_EXIT_HLT) return;
-      fprintf(stderr,	"Got exit_reason %d at pc = 0x%llx, expected KVM_EXIT_DEBUG (%d)\n",
-          vcpu.kvm_run->exit_reason, vcpu.kvm_run->s.regs.regs.rip, KVM_EXIT_DEBUG);
-      assert(0);
-    } else {
-      patching_after(pc);
-      if (vcpu.int_wp_state == STATE_INT_INST) {
-        uint32_t eflag_offset = 8 + (vcpu.has_error_code ? 4 : 0);
-        uint32_t eflag_addr = va2pa(vcpu.kvm_run->s.regs.regs.rsp + eflag_offset);
-        *(uint32_t *)(vm.mem + eflag_addr) &= ~RFLAGS_FIX_MASK;
-
-        Assert(vcpu.entry == vcpu.kvm_run->debug.arch.pc,
-            "entry not match, right = 0x%llx, wrong = 0x%x", vcpu.kvm_run->debug.arch.pc, vcpu.entry);
-        kvm_set_step_mode(false, 0);
-        vcpu.int_wp_state = STATE_IDLE;
-      //Log("exception = %d, pc = %llx, dr6 = %llx, dr7 = %llx", vcpu.kvm_run->debug.arch.exception,
-      //    vcpu.kvm_run->debug.arch.pc, vcpu.kvm_run->debug.arch.dr6, vcpu.kvm_run->debug.arch.dr7);
-      } else if (vcpu.int_wp_state == STATE_IRET_INST) {
-        Assert(vcpu.entry == vcpu.kvm_run->debug.arch.pc,
-            "entry not match, right = 0x%llx, wrong = 0x%x", vcpu.kvm_run->debug.arch.pc, vcpu.entry);
-        kvm_set_step_mode(false, 0);
-        vcpu.int_wp_state = STATE_IDLE;
-      }
+  if (vcpu.kvm_run->exit_reason != KVM_EXIT_DEBUG) {
+    if (vcpu.kvm_run->exit_reason == KVM_EXIT_HLT) return false;
+    fprintf(stderr,	"Got exit_reason %d at pc = 0x%llx, expected KVM_EXIT_DEBUG (%d)\n",
+        vcpu.kvm_run->exit_reason, vcpu.kvm_run->s.regs.regs.rip, KVM_EXIT_DEBUG);
+    assert(0);
+  } else {
+    patching_after(pc);
+    if (vcpu.int_wp_state == STATE_INT_INST) {
+      uint32_t eflag_offset = 8 + (vcpu.has_error_code ? 4 : 0);
+      uint32_t eflag_addr = va2pa(vcpu.kvm_run->s.regs.regs.rsp + eflag_offset);
+      *(uint32_t *)(vm.mem + eflag_addr) &= ~RFLAGS_FIX_MASK;
+
+      Assert(vcpu.entry == vcpu.kvm_run->debug.arch.pc,
+          "entry not match, right = 0x%llx, wrong = 0x%x", vcpu.kvm_run->debug.arch.pc, vcpu.entry);
+      kvm_set_step_mode(false, 0);
+      vcpu.int_wp_state = STATE_IDLE;
+    //Log("exception = %d, pc = %llx, dr6 = %llx, dr7 = %llx", vcpu.kvm_run->debug.arch.exception,
+    //    vcpu.kvm_run->debug.arch.pc, vcpu.kvm_run->debug.arch.dr6, vcpu.kvm_run->debug.arch.dr7);
+    } else if (vcpu.int_wp_state == STATE_IRET_INST) {
+      Assert(vcpu.entry == vcpu.kvm_run->debug.arch.pc,
+          "entry not match, right = 0x%llx, wrong = 0x%x", vcpu.kvm_run->debug.arch.pc, vcpu.entry);
+      kvm_set_step_mode(false, 0);
+      vcpu.int_wp_state = STATE_IDLE;
     }
   }
+  return true;
+}
+
+static void kvm_exec(uint64_t n) {
+  while (n > 0) {
+#ifdef CONFIG_DIFFTEST_KVM_NATIVE
+    // the watchpoint for int/iret needs single-step
+    if (n >= BATCH_MIN && vcpu.int_wp_state == STATE_IDLE) {
+      bool halt;
+      uint64_t count = kvm_run_batch(n - BATCH_SKID, &halt);
+      Assert(count <= n, "Run %ld instructions in a batch of %ld, try a larger BATCH_SKID", count, n);
+      n -= count;
+      if (halt || n == 0) return;
+    }
+#endif
+    if (!kvm_step()) return;
+    n --;
+  }
 }
 
 static void run_protected_mode() {
@@ -351,6 +748,10 @@ __EXPORT void difftest_memcpy(paddr_t addr, void *buf, size_t n, bool direction)
   else memcpy(buf, vm.mem + addr, n);
 }
 
+__EXPORT uint64_t difftest_memhash(paddr_t addr, size_t n) {
+  return difftest_hash(vm.mem + addr, n);
+}
+
 __EXPORT void difftest_regcpy(void *r, bool direction) {
   struct kvm_regs *ref = &(vcpu.kvm_run->s.regs.regs);
   x86_CPU_state *x86 = r;
@@ -402,8 +803,16 @@ __EXPORT void difftest_raise_intr(word_t NO) {
   }
 }
 
+static int share_fd = -1;
+
+__EXPORT void difftest_memshare(int fd, size_t size) {
+  assert(size == CONFIG_MSIZE);
+  share_fd = fd;
+}
+
 __EXPORT void difftest_init(int port) {
-  vm_init(CONFIG_MSIZE);
+  vm_init(CONFIG_MSIZE, share_fd);
   vcpu_init();
   run_protected_mode();
+  IFDEF(CONFIG_DIFFTEST_KVM_NATIVE, perf_probe());
 }
@@ -34,4 +34,8 @@ void gdb_send(struct gdb_conn *conn, const uint8_t *command, size_t size);
 
 uint8_t *gdb_recv(struct gdb_conn *conn, size_t *size);
 
+bool gdb_wait(struct gdb_conn *conn, int timeout_ms);
+
+void gdb_interrupt(struct gdb_conn *conn);
+
 const char * gdb_start_noack(struct gdb_conn *conn);
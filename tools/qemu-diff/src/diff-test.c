@@ -20,19 +20,30 @@
 
 bool gdb_connect_qemu(int);
 bool gdb_memcpy_to_qemu(uint32_t, void *, int);
+bool gdb_memcpy_from_qemu(uint32_t, void *, int);
 bool gdb_getregs(union isa_gdb_regs *);
 bool gdb_setregs(union isa_gdb_regs *);
 bool gdb_si();
+bool gdb_breakpoint(uint32_t, bool);
+bool gdb_cont(int);
 void gdb_exit();
 
 void init_isa();
 
 __EXPORT void difftest_memcpy(paddr_t addr, void *buf, size_t n, bool direction) {
-  assert(direction == DIFFTEST_TO_REF);
-  if (direction == DIFFTEST_TO_REF) {
-    bool ok = gdb_memcpy_to_qemu(addr, buf, n);
-    assert(ok == 1);
-  }
+  bool ok = (direction == DIFFTEST_TO_REF ? gdb_memcpy_to_qemu(addr, buf, n) :
+                                            gdb_memcpy_from_qemu(addr, buf, n));
+  assert(ok == 1);
+}
+
+__EXPORT uint64_t difftest_memhash(paddr_t addr, size_t n) {
+  uint8_t *buf = malloc(n);
+  assert(buf != NULL);
+  bool ok = gdb_memcpy_from_qemu(addr, buf, n);
+  assert(ok == 1);
+  uint64_t h = difftest_hash(buf, n);
+  free(buf);
+  return h;
 }
 
 __EXPORT void difftest_regcpy(void *dut, bool direction) {
@@ -50,6 +61,60 @@ __EXPORT void difftest_exec(uint64_t n) {
   while (n --) gdb_si();
 }
 
+// pc is the last register in the DUT state
+static uint64_t dut_pc(const uint8_t *d) {
+#if defined(CONFIG_ISA_riscv) && defined(CONFIG_RV64)
+  return *(uint64_t *)(d + DIFFTEST_REG_SIZE - sizeof(uint64_t));
+#else
+  return *(uint32_t *)(d + DIFFTEST_REG_SIZE - sizeof(uint32_t));
+#endif
+}
+
+static bool dut_match(const uint8_t *d) {
+  union isa_gdb_regs qemu_r;
+  gdb_getregs(&qemu_r);
+  return memcmp(&qemu_r, d, DIFFTEST_REG_SIZE) == 0;
+}
+
+#define CONT_TIMEOUT_MS 1000
+
+// Execute `n` instructions, and compare the registers with the DUT states
+// at `dut`, `stride` bytes apart. QEMU can not step more than one
+// instruction at a time, so a temporary breakpoint is set at the pc after
+// the last instruction, and QEMU continues from one hit to the next. The
+// registers are only compared at the hits, so a mismatch may be reported
+// some instructions after the actual divergence. Return the number of
+// instructions matched.
+__EXPORT uint64_t difftest_exec_cmp(uint64_t n, const void *dut, size_t stride) {
+  if (n == 0) return 0;
+  const uint8_t *d = dut;
+  uint64_t target = dut_pc(d + (n - 1) * stride);
+  uint64_t i, nr_hit = 0;
+  for (i = 0; i < n; i ++) nr_hit += (dut_pc(d + i * stride) == target);
+
+  if (nr_hit * 2 > n) {
+    // a tight loop, stepping costs less
+    for (i = 0; i < n; i ++) {
+      gdb_si();
+      if (!dut_match(d + i * stride)) return i;
+    }
+    return n;
+  }
+
+  gdb_breakpoint(target, true);
+  for (i = 0; i < n; i ++) {
+    // step over the instruction, in case that the breakpoint is at the current pc
+    gdb_si();
+    uint64_t j = i;
+    while (dut_pc(d + j * stride) != target) j ++;
+    if (j > i) gdb_cont(CONT_TIMEOUT_MS);
+    i = j;
+    if (!dut_match(d + i * stride)) break;
+  }
+  gdb_breakpoint(target, false);
+  return i;
+}
+
 __EXPORT void difftest_init(int port) {
   char buf[32];
   sprintf(buf, "tcp::%d", port);
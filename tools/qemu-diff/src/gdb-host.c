@@ -16,6 +16,47 @@
 #include "common.h"
 
 static struct gdb_conn *conn;
+// the max size of a packet supported by QEMU, negotiated by qSupported
+static int packet_size = 1500;
+// whether QEMU accepts the binary `X` packet, probed at the first write
+static enum { X_UNKNOWN, X_YES, X_NO } x_support = X_UNKNOWN;
+
+// the registers of QEMU, valid until QEMU executes instructions
+static union isa_gdb_regs regs_cache;
+static bool regs_cache_valid = false;
+
+static const char hex_digit[] = "0123456789abcdef";
+
+static int hex_encode_buf(char *dest, const void *src, int len) {
+  const uint8_t *s = src;
+  int i;
+  for (i = 0; i < len; i ++) {
+    dest[i * 2] = hex_digit[s[i] >> 4];
+    dest[i * 2 + 1] = hex_digit[s[i] & 0xf];
+  }
+  return len * 2;
+}
+
+static bool recv_ok() {
+  size_t size;
+  uint8_t *reply = gdb_recv(conn, &size);
+  bool ok = !strcmp((const char*)reply, "OK");
+  free(reply);
+  return ok;
+}
+
+static void query_packet_size() {
+  const char cmd[] = "qSupported";
+  gdb_send(conn, (const uint8_t *)cmd, sizeof(cmd) - 1);
+  size_t size;
+  uint8_t *reply = gdb_recv(conn, &size);
+  char *p = strstr((char *)reply, "PacketSize=");
+  if (p != NULL) {
+    int n = strtol(p + strlen("PacketSize="), NULL, 16);
+    if (n > 64) packet_size = n;
+  }
+  free(reply);
+}
 
 bool gdb_connect_qemu(int port) {
   // connect to gdbserver on localhost port 1234
@@ -23,43 +64,115 @@ bool gdb_connect_qemu(int port) {
     usleep(1);
   }
 
+  query_packet_size();
+  // no need to wait for the acknowledgment of every packet over TCP
+  gdb_start_noack(conn);
   return true;
 }
 
-static bool gdb_memcpy_to_qemu_small(uint32_t dest, void *src, int len) {
-  char *buf = malloc(len * 2 + 128);
+#define X_HDR_MAX 32
+
+// Send at most `len` bytes with an `X` packet, and return the number of
+// bytes sent. The payload is binary, with '#', '$', '}' and '*' escaped.
+static int gdb_memcpy_to_qemu_x(uint32_t dest, void *src, int len, bool *ok) {
+  char *buf = malloc(X_HDR_MAX + packet_size);
   assert(buf != NULL);
-  int p = sprintf(buf, "M0x%x,%x:", dest, len);
-  int i;
-  for (i = 0; i < len; i ++) {
-    p += sprintf(buf + p, "%c%c", hex_encode(((uint8_t *)src)[i] >> 4), hex_encode(((uint8_t *)src)[i] & 0xf));
+  char *data = buf + X_HDR_MAX, *p = data;
+  char *limit = data + packet_size - X_HDR_MAX - 1; // an escaped byte takes 2
+  uint8_t *s = src;
+  int n;
+  for (n = 0; n < len && p < limit; n ++) {
+    uint8_t c = s[n];
+    if (c == '#' || c == '$' || c == '}' || c == '*') {
+      *p ++ = '}';
+      c ^= 0x20;
+    }
+    *p ++ = c;
   }
 
-  gdb_send(conn, (const uint8_t *)buf, strlen(buf));
+  char hdr[X_HDR_MAX];
+  int hdr_len = snprintf(hdr, sizeof(hdr), "X%x,%x:", dest, n);
+  memcpy(data - hdr_len, hdr, hdr_len);
+  gdb_send(conn, (const uint8_t *)data - hdr_len, hdr_len + (p - data));
   free(buf);
 
   size_t size;
   uint8_t *reply = gdb_recv(conn, &size);
-  bool ok = !strcmp((const char*)reply, "OK");
+  if (x_support == X_UNKNOWN) x_support = (size == 0 ? X_NO : X_YES);
+  *ok = !strcmp((const char*)reply, "OK");
   free(reply);
+  return n;
+}
 
-  return ok;
+// Send at most `len` bytes with an `M` packet in hex, and return the
+// number of bytes sent.
+static int gdb_memcpy_to_qemu_m(uint32_t dest, void *src, int len, bool *ok) {
+  char *buf = malloc(packet_size + 1);
+  assert(buf != NULL);
+  int p = sprintf(buf, "M%x,", dest);
+  int n = (packet_size - p - 16) / 2;
+  if (n > len) n = len;
+  p += sprintf(buf + p, "%x:", n);
+  p += hex_encode_buf(buf + p, src, n);
+
+  gdb_send(conn, (const uint8_t *)buf, p);
+  free(buf);
+
+  *ok = recv_ok();
+  return n;
 }
 
 bool gdb_memcpy_to_qemu(uint32_t dest, void *src, int len) {
-  const int mtu = 1500;
   bool ok = true;
-  while (len > mtu) {
-    ok &= gdb_memcpy_to_qemu_small(dest, src, mtu);
-    dest += mtu;
-    src += mtu;
-    len -= mtu;
+  if (x_support == X_UNKNOWN) {
+    // probe with an empty write, which gets an empty reply if unsupported
+    bool ok_probe;
+    gdb_memcpy_to_qemu_x(dest, src, 0, &ok_probe);
+  }
+  while (len > 0) {
+    bool ok_this;
+    int n = (x_support == X_YES ? gdb_memcpy_to_qemu_x(dest, src, len, &ok_this) :
+                                  gdb_memcpy_to_qemu_m(dest, src, len, &ok_this));
+    ok &= ok_this;
+    dest += n;
+    src += n;
+    len -= n;
   }
-  ok &= gdb_memcpy_to_qemu_small(dest, src, len);
   return ok;
 }
 
+bool gdb_memcpy_from_qemu(uint32_t src, void *dest, int len) {
+  char cmd[64];
+  uint8_t *d = dest;
+  // the reply is in hex
+  const int chunk = (packet_size - 16) / 2;
+  while (len > 0) {
+    int n = (len < chunk ? len : chunk);
+    int cmd_len = snprintf(cmd, sizeof(cmd), "m%x,%x", src, n);
+    gdb_send(conn, (const uint8_t *)cmd, cmd_len);
+    size_t size;
+    uint8_t *reply = gdb_recv(conn, &size);
+    bool ok = (size == n * 2);
+    int i;
+    for (i = 0; ok && i < n; i ++) {
+      uint16_t byte = gdb_decode_hex(reply[i * 2], reply[i * 2 + 1]);
+      ok = (byte != UINT16_MAX);
+      d[i] = byte;
+    }
+    free(reply);
+    if (!ok) return false;
+    src += n;
+    d += n;
+    len -= n;
+  }
+  return true;
+}
+
 bool gdb_getregs(union isa_gdb_regs *r) {
+  if (regs_cache_valid) {
+    *r = regs_cache;
+    return true;
+  }
   gdb_send(conn, (const uint8_t *)"g", 1);
   size_t size;
   uint8_t *reply = gdb_recv(conn, &size);
@@ -77,6 +190,8 @@ bool gdb_getregs(union isa_gdb_regs *r) {
 
   free(reply);
 
+  regs_cache = *r;
+  regs_cache_valid = true;
   return true;
 }
 
@@ -85,32 +200,47 @@ bool gdb_setregs(union isa_gdb_regs *r) {
   char *buf = malloc(len * 2 + 128);
   assert(buf != NULL);
   buf[0] = 'G';
+  int p = 1 + hex_encode_buf(buf + 1, r, len);
 
-  void *src = r;
-  int p = 1;
-  int i;
-  for (i = 0; i < len; i ++) {
-    p += sprintf(buf + p, "%c%c", hex_encode(((uint8_t *)src)[i] >> 4), hex_encode(((uint8_t *)src)[i] & 0xf));
-  }
-
-  gdb_send(conn, (const uint8_t *)buf, strlen(buf));
+  gdb_send(conn, (const uint8_t *)buf, p);
   free(buf);
 
+  // read the registers back next time, since QEMU may not take all of them
+  regs_cache_valid = false;
+  return recv_ok();
+}
+
+bool gdb_si() {
+  regs_cache_valid = false;
+  char buf[] = "vCont;s:1";
+  gdb_send(conn, (const uint8_t *)buf, strlen(buf));
   size_t size;
   uint8_t *reply = gdb_recv(conn, &size);
-  bool ok = !strcmp((const char*)reply, "OK");
   free(reply);
+  return true;
+}
 
-  return ok;
+bool gdb_breakpoint(uint32_t addr, bool insert) {
+  char cmd[32];
+  // QEMU ignores the kind of the breakpoint
+  int len = snprintf(cmd, sizeof(cmd), "%c0,%x,1", insert ? 'Z' : 'z', addr);
+  gdb_send(conn, (const uint8_t *)cmd, len);
+  return recv_ok();
 }
 
-bool gdb_si() {
-  char buf[] = "vCont;s:1";
+// Continue until a breakpoint is hit. QEMU is stopped after `timeout_ms`
+// in case that it never reaches the breakpoints.
+bool gdb_cont(int timeout_ms) {
+  regs_cache_valid = false;
+  char buf[] = "vCont;c";
   gdb_send(conn, (const uint8_t *)buf, strlen(buf));
+  bool hit = gdb_wait(conn, timeout_ms);
+  // if a breakpoint is hit just now, the interrupt is ignored by QEMU
+  if (!hit) gdb_interrupt(conn);
   size_t size;
   uint8_t *reply = gdb_recv(conn, &size);
   free(reply);
-  return true;
+  return hit;
 }
 
 void gdb_exit() {
@@ -25,6 +25,7 @@
 
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <poll.h>
 
 #include <sys/socket.h>
 #include <sys/types.h>
@@ -273,6 +274,19 @@ static uint8_t* recv_packet(FILE *in, size_t *ret_size, bool* ret_sum_ok) {
     errx(1, "recv: Unknown connection error");
 }
 
+// Wait for a reply until `timeout_ms`, and return whether it arrives.
+// All replies before are received, so nothing is left in the buffer of `in`.
+bool gdb_wait(struct gdb_conn *conn, int timeout_ms) {
+  struct pollfd pfd = { .fd = fileno(conn->in), .events = POLLIN };
+  return poll(&pfd, 1, timeout_ms) > 0;
+}
+
+// stop the running target, which sends a stop reply
+void gdb_interrupt(struct gdb_conn *conn) {
+  fputc(0x03, conn->out);
+  fflush(conn->out);
+}
+
 uint8_t* gdb_recv(struct gdb_conn *conn, size_t *size) {
   uint8_t *reply;
   bool acked = false;
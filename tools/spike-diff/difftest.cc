@@ -70,11 +70,36 @@ void sim_t::diff_set_regs(void* diff_context) {
   state->pc = ctx->pc;
 }
 
+// copy page by page with the backing pages of mem_t
+static void mem_copy(reg_t addr, void *buf, size_t n, bool to_ref) {
+  reg_t base = difftest_mem[0].first;
+  mem_t *mem = difftest_mem[0].second;
+  assert(addr >= base && addr - base + n <= mem->size());
+  reg_t off = addr - base;
+  uint8_t *b = (uint8_t *)buf;
+  while (n > 0) {
+    size_t len = std::min<size_t>(n, PGSIZE - off % PGSIZE);
+    char *page = mem->contents(off);
+    if (to_ref) memcpy(page, b, len);
+    else memcpy(b, page, len);
+    off += len;
+    b += len;
+    n -= len;
+  }
+}
+
 void sim_t::diff_memcpy(reg_t dest, void* src, size_t n) {
-  mmu_t* mmu = p->get_mmu();
-  for (size_t i = 0; i < n; i++) {
-    mmu->store<uint8_t>(dest+i, *((uint8_t*)src+i));
+  mem_copy(dest, src, n, true);
+  // the instructions decoded before may be overwritten
+  p->get_mmu()->flush_icache();
+}
+
+static bool diff_match(const void* diff_context) {
+  const struct diff_context_t* ctx = (const struct diff_context_t*)diff_context;
+  for (int i = 0; i < NR_GPR; i++) {
+    if ((word_t)state->XPR[i] != ctx->gpr[i]) return false;
   }
+  return (word_t)state->pc == ctx->pc;
 }
 
 extern "C" {
@@ -83,10 +108,21 @@ __EXPORT void difftest_memcpy(paddr_t addr, void *buf, size_t n, bool direction)
   if (direction == DIFFTEST_TO_REF) {
     s->diff_memcpy(addr, buf, n);
   } else {
-    assert(0);
+    mem_copy(addr, buf, n, false);
   }
 }
 
+__EXPORT uint64_t difftest_memhash(paddr_t addr, size_t n) {
+  reg_t off = addr - difftest_mem[0].first;
+  if (off % PGSIZE + n <= PGSIZE) {
+    // within a single page of mem_t
+    return difftest_hash(difftest_mem[0].second->contents(off), n);
+  }
+  std::vector<uint8_t> buf(n);
+  mem_copy(addr, buf.data(), n, false);
+  return difftest_hash(buf.data(), n);
+}
+
 __EXPORT void difftest_regcpy(void* dut, bool direction) {
   if (direction == DIFFTEST_TO_REF) {
     s->diff_set_regs(dut);
@@ -99,6 +135,20 @@ __EXPORT void difftest_exec(uint64_t n) {
   s->diff_step(n);
 }
 
+// Execute at most `n` instructions, and compare the registers after each of
+// them with the DUT states in `dut`, which are `stride` bytes apart. Exactly
+// the registers in diff_context_t (GPRs and pc) are compared, the same as
+// difftest_regcpy() copies. Stop at the first mismatch, and return the
+// number of instructions matched.
+__EXPORT uint64_t difftest_exec_cmp(uint64_t n, const void *dut, size_t stride) {
+  const uint8_t *d = (const uint8_t *)dut;
+  for (uint64_t i = 0; i < n; i++, d += stride) {
+    s->diff_step(1);
+    if (!diff_match(d)) return i;
+  }
+  return n;
+}
+
 __EXPORT void difftest_init(int port) {
   difftest_htif_args.push_back("");
   const char *isa = "RV" MUXDEF(CONFIG_RV64, "64", "32") MUXDEF(CONFIG_RVE, "E", "I") "MAFDC";